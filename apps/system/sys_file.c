@@ -7,31 +7,369 @@
  */
 
 #include "app.h"
+#include "dir.h"
 #include "inode.h"
 
 int getsize(inode_intf bs, uint ino) { return FILE_SYS_DISK_SIZE / BLOCK_SIZE; }
 
 int setsize(inode_intf bs, uint ino, uint newsize) { FATAL("cannot set size"); }
 
-int read(inode_intf bs, uint ino, uint offset, block_t* block) {
-    earth->disk_read(FILE_SYS_DISK_START + offset, 1, block->bytes);
+/* The block I/O layer below the file system: writes wait in bio_queue and
+ * go to the disk in the order of an elevator (C-LOOK), with contiguous
+ * blocks merged into one multi-block transfer; a read goes to the disk right
+ * away unless its block is queued. The queue is sent to the disk when full
+ * and after each file request, so a write waits for at most one request. */
+#define BIO_QUEUE_DEPTH 32
+#define BIO_BENCH       0 /* set to 1 to measure the block I/O layer */
+
+static uint bio_head, bio_nqueued, bio_queued_no[BIO_QUEUE_DEPTH];
+static block_t bio_queued[BIO_QUEUE_DEPTH], bio_run[BIO_QUEUE_DEPTH];
+static struct {
+    uint reads, writes, absorbed; /* absorbed: writes to a queued block */
+    uint read_cmds, write_cmds, write_blocks, cycles;
+} bio_stats;
+
+static uint cycles() {
+    uint cycle;
+    asm volatile("csrr %0, cycle" : "=r"(cycle));
+    return cycle;
+}
+
+static void bio_disk(uint offset, uint nblocks, block_t* blocks, int write) {
+    uint start = cycles();
+    grass->sys_disk(FILE_SYS_DISK_START + offset, nblocks, blocks->bytes, write);
+    bio_stats.cycles += cycles() - start;
+    write ? bio_stats.write_cmds++ : bio_stats.read_cmds++;
+}
+
+static int bio_find(uint offset) {
+    for (uint i = 0; i < bio_nqueued; i++)
+        if (bio_queued_no[i] == offset) return i;
+    return -1;
+}
+
+void bio_sync() {
+    /* Sort the queue and write from the block after the last one written up
+     * to the highest queued block, and then from the lowest one. */
+    uint n = bio_nqueued, order[BIO_QUEUE_DEPTH], first = 0;
+    for (uint i = 0, j; i < n; order[j] = i++)
+        for (j = i; j > 0 && bio_queued_no[order[j - 1]] > bio_queued_no[i]; j--)
+            order[j] = order[j - 1];
+    while (first < n && bio_queued_no[order[first]] < bio_head) first++;
+
+    for (uint i = 0, len = 0; i < n; i++) {
+        uint slot = order[(first + i) % n], next = order[(first + i + 1) % n];
+        uint block_no = bio_queued_no[slot];
+        memcpy(&bio_run[len++], &bio_queued[slot], BLOCK_SIZE);
+        if (i + 1 < n && bio_queued_no[next] == block_no + 1) continue;
+
+        bio_disk(block_no + 1 - len, len, bio_run, 1);
+        bio_stats.write_blocks += len;
+        bio_head = block_no + 1;
+        len      = 0;
+    }
+    bio_nqueued = 0;
+}
+
+int read_range(inode_intf bs, uint ino, uint offset, uint nblocks,
+               block_t* blocks) {
+    /* Read each run of blocks which are not queued in one transfer. */
+    bio_stats.reads += nblocks;
+    for (uint i = 0, len; i < nblocks; i += len) {
+        int slot = bio_find(offset + i);
+        len      = 1;
+        if (slot >= 0) {
+            memcpy(&blocks[i], &bio_queued[slot], BLOCK_SIZE);
+            continue;
+        }
+        while (i + len < nblocks && bio_find(offset + i + len) < 0) len++;
+        bio_disk(offset + i, len, &blocks[i], 0);
+    }
     return 0;
 }
 
+int read(inode_intf bs, uint ino, uint offset, block_t* block) {
+    return read_range(bs, ino, offset, 1, block);
+}
+
+/* Readahead: a read of the file server that continues the previous one of
+ * the same inode doubles the inode's window, up to RA_MAX_BLOCKS, and the
+ * file blocks up to the window past the read are read into the block cache
+ * with one read_range(), so that blocks contiguous on the disk are read at
+ * once. */
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 32
+static struct {
+    uint next, window, end; /* end: the first file block not read ahead */
+} ra[NINODES];
+static block_t ra_blocks[RA_MAX_BLOCKS];
+
+static void readahead(inode_intf fs, uint ino, uint offset, uint nblocks) {
+    if (ino >= NINODES) return;
+    uint next = offset + nblocks;
+    if (offset != ra[ino].next) {
+        ra[ino].window = 0;
+        ra[ino].end    = next;
+    } else if (ra[ino].window < RA_MAX_BLOCKS) {
+        ra[ino].window = ra[ino].window ? ra[ino].window * 2 : RA_MIN_BLOCKS;
+    }
+    ra[ino].next = next;
+
+    /* Read ahead again once half of the window has been consumed. */
+    uint end = next + ra[ino].window;
+    if (ra[ino].end < next) ra[ino].end = next;
+    if (end - ra[ino].end < ra[ino].window / 2) return;
+
+    int size = fs->getsize(fs, ino);
+    if (size >= 0 && end > size) end = size;
+    if (end > ra[ino].end)
+        inode_read_range(fs, ino, ra[ino].end, end - ra[ino].end, ra_blocks);
+    ra[ino].end = next + ra[ino].window;
+}
+
 int write(inode_intf bs, uint ino, uint offset, block_t* block) {
-    earth->disk_write(FILE_SYS_DISK_START + offset, 1, block->bytes);
+    bio_stats.writes++;
+    int slot = bio_find(offset);
+    if (slot >= 0) {
+        bio_stats.absorbed++;
+    } else {
+        if (bio_nqueued == BIO_QUEUE_DEPTH) bio_sync();
+        slot                = bio_nqueued++;
+        bio_queued_no[slot] = offset;
+    }
+    memcpy(&bio_queued[slot], block, BLOCK_SIZE);
+    return 0;
+}
+
+int write_range(inode_intf bs, uint ino, uint offset, uint nblocks,
+                block_t* blocks) {
+    /* A short range goes to the queue, and a long one straight to the disk
+     * in one transfer, replacing the queued copies of its blocks. */
+    if (nblocks < RA_MIN_BLOCKS) {
+        for (uint i = 0; i < nblocks; i++)
+            write(bs, ino, offset + i, &blocks[i]);
+        return 0;
+    }
+    for (uint i = 0; i < bio_nqueued;) {
+        if (bio_queued_no[i] - offset >= nblocks) {
+            i++;
+            continue;
+        }
+        bio_stats.absorbed++;
+        bio_queued_no[i] = bio_queued_no[--bio_nqueued];
+        memcpy(&bio_queued[i], &bio_queued[bio_nqueued], BLOCK_SIZE);
+    }
+    bio_stats.writes += nblocks;
+    bio_stats.write_blocks += nblocks;
+    bio_disk(offset, nblocks, blocks, 1);
+    return 0;
+}
+
+static void bio_print_stats(char* workload) {
+    uint blocks = bio_stats.reads + bio_stats.write_blocks - bio_stats.absorbed;
+    INFO("sys_file: %s: %d reads, %d writes in %d commands (%d%% merged), "
+         "%d blocks per write command, %d cycles per block",
+         workload, bio_stats.reads, bio_stats.writes,
+         bio_stats.read_cmds + bio_stats.write_cmds,
+         bio_stats.writes
+             ? 100 - bio_stats.write_cmds * 100 / bio_stats.writes
+             : 0,
+         bio_stats.write_cmds ? bio_stats.write_blocks / bio_stats.write_cmds
+                              : 0,
+         bio_stats.cycles / (blocks ? blocks : 1));
+    memset(&bio_stats, 0, sizeof(bio_stats));
+}
+
+static void bio_bench() {
+    /* Use the swap area right after the file system, as disk_test() does in
+     * earth/dev_disk.c, which holds nothing before user apps start. */
+    block_t block;
+    uint base = FILE_SYS_DISK_SIZE / BLOCK_SIZE, seed = 1;
+    for (uint i = 0; i < 256; i++) write(NULL, 0, base + i, &block);
+    bio_sync();
+    for (uint i = 0; i < 256; i++) read(NULL, 0, base + i, &block);
+    bio_print_stats("sequential");
+
+    /* Mix reads and writes to random blocks, two writes for each read. */
+    for (uint i = 0; i < 256; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint offset = base + (seed >> 16) % 256;
+        (i % 3 == 0) ? read(NULL, 0, offset, &block)
+                     : write(NULL, 0, offset, &block);
+    }
+    bio_sync();
+    bio_print_stats("mixed");
+}
+
+/* FILE_READ and FILE_WRITE move a range of bytes through stream, up to
+ * STREAM_NBLOCKS blocks at a time, with one read_range() or write_range()
+ * for each window of the range; see struct file_request in servers.h. */
+#define STREAM_NBLOCKS 32
+static block_t stream[STREAM_NBLOCKS];
+
+static uint stream_window(uint pos, uint end, uint* first) {
+    /* Return the number of blocks of the window holding pos. */
+    uint nblocks = (end - 1) / BLOCK_SIZE + 1 - pos / BLOCK_SIZE;
+    *first       = pos / BLOCK_SIZE;
+    return nblocks < STREAM_NBLOCKS ? nblocks : STREAM_NBLOCKS;
+}
+
+static int stream_read(inode_intf fs, int receiver, uint ino, uint pos,
+                       uint len) {
+    char buf[SYSCALL_MSG_LEN];
+    struct file_reply* reply = (void*)buf;
+    reply->len = reply->remaining = 0;
+
+    /* The range stops at the end of the file. */
+    int size = fs->getsize(fs, ino);
+    uint end = pos + len, file_end = size * BLOCK_SIZE;
+    if (size < 0 || pos >= file_end) goto fail;
+    if (end > file_end || end < pos) end = file_end;
+
+    reply->status = FILE_OK;
+    if (pos == end)
+        grass->sys_send(receiver, buf, sizeof(*reply) - FILE_DATA_LEN);
+    while (pos < end) {
+        uint first, nblocks = stream_window(pos, end, &first);
+        if (inode_read_range(fs, ino, first, nblocks, stream) < 0) goto fail;
+
+        uint window_start = first * BLOCK_SIZE;
+        uint window_end   = (first + nblocks) * BLOCK_SIZE;
+        if (window_end > end) window_end = end;
+        for (; pos < window_end; pos += reply->len) {
+            reply->len = window_end - pos;
+            if (reply->len > FILE_DATA_LEN) reply->len = FILE_DATA_LEN;
+            reply->remaining = end - pos - reply->len;
+            memcpy(reply->data, (char*)stream + pos - window_start, reply->len);
+            grass->sys_send(receiver, buf,
+                            sizeof(*reply) - FILE_DATA_LEN + reply->len);
+        }
+    }
     return 0;
+
+fail:
+    reply->status = FILE_ERROR;
+    grass->sys_send(receiver, buf, sizeof(*reply) - FILE_DATA_LEN);
+    return -1;
+}
+
+static int stream_fill(inode_intf fs, uint ino, uint offset, int size,
+                       block_t* block) {
+    /* Read a block which is only partly written, or zero it if it is beyond
+     * the end of the file. */
+    if (offset < size) return fs->read(fs, ino, offset, block);
+    memset(block, 0, BLOCK_SIZE);
+    return 0;
+}
+
+static int stream_write(inode_intf fs, int sender, struct file_request* req) {
+    /* req holds the first message, and the next ones are received into it;
+     * all of them are received even after an error, since the sender only
+     * waits for the reply after sending the whole range. */
+    uint ino = req->ino, pos = req->offset, len = req->len, end = pos + len;
+    uint avail = (len < FILE_DATA_LEN) ? len : FILE_DATA_LEN, used = 0;
+    uint received = avail;
+    int size = fs->getsize(fs, ino), r = (size < 0 || end < pos) ? -1 : 0;
+    if (r < 0) end = pos;
+
+    while (pos < end) {
+        uint first, nblocks = stream_window(pos, end, &first);
+        uint last           = first + nblocks - 1;
+        uint window_start   = first * BLOCK_SIZE;
+        uint window_end     = (last + 1) * BLOCK_SIZE;
+        if (window_end > end) window_end = end;
+
+        if (r == 0 && pos % BLOCK_SIZE)
+            r = stream_fill(fs, ino, first, size, &stream[0]);
+        if (r == 0 && window_end % BLOCK_SIZE)
+            r = stream_fill(fs, ino, last, size, &stream[nblocks - 1]);
+
+        while (pos < window_end) {
+            if (used == avail) {
+                grass->sys_recv(sender, NULL, (void*)req, SYSCALL_MSG_LEN);
+                avail = (end - pos < FILE_DATA_LEN) ? end - pos : FILE_DATA_LEN;
+                used  = 0;
+                received += avail;
+            }
+            uint n = avail - used;
+            if (n > window_end - pos) n = window_end - pos;
+            memcpy((char*)stream + pos - window_start, req->data + used, n);
+            used += n;
+            pos += n;
+        }
+        if (r == 0) r = inode_write_range(fs, ino, first, nblocks, stream);
+    }
+
+    /* Receive what is left of a range rejected before the loop. */
+    for (; received < len; received += FILE_DATA_LEN)
+        grass->sys_recv(sender, NULL, (void*)req, SYSCALL_MSG_LEN);
+    return r;
 }
 
+/* The dentry cache maps a directory inode and a name to the inode of the
+ * name, so that most lookups read no directory block; FILE_WRITE to a
+ * directory drops its entries. */
+#define DCACHE_NENTRIES 64
+static struct dentry {
+    uint dir;
+    int ino;
+    char name[DIR_NAME_LEN]; /* "" if the entry is unused */
+} dcache[DCACHE_NENTRIES];
+
+static int dentry_lookup(inode_intf fs, uint dir, char* name) {
+    uint hash        = dir_hash(name);
+    struct dentry* d = &dcache[(hash ^ dir * 2654435761u) % DCACHE_NENTRIES];
+    if (d->name[0] && d->dir == dir && !strcmp(d->name, name)) return d->ino;
+
+    /* Probe the blocks of the directory from the one of the hash. */
+    int nblocks = fs->getsize(fs, dir);
+    if (nblocks <= 0 || strlen(name) >= DIR_NAME_LEN) return -1;
+    struct dir_block block;
+    for (uint i = 0; i < nblocks; i++) {
+        if (fs->read(fs, dir, (hash + i) % nblocks, (void*)&block) < 0)
+            return -1;
+        for (uint j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+            struct dir_entry* e = &block.entries[j];
+            if (e->name[0] == 0) return -1;
+            if (strncmp(e->name, name, DIR_NAME_LEN)) continue;
+
+            d->dir = dir;
+            d->ino = e->ino;
+            strcpy(d->name, name);
+            return e->ino;
+        }
+    }
+    return -1;
+}
+
+static void dentry_invalidate(uint dir) {
+    for (uint i = 0; i < DCACHE_NENTRIES; i++)
+        if (dcache[i].dir == dir) dcache[i].name[0] = 0;
+}
+
+/* The block cache between the file system and the block I/O layer; its
+ * dirty blocks are written back after each file request. */
+#define CACHE_NBLOCKS     128
+#define CACHE_STATS_EVERY 1024 /* requests between two cache_stats() */
+
 int main() {
     SUCCESS("Enter kernel process GPID_FILE");
 
     /* Initialize the file system interface. */
     struct inode_store disk = (struct inode_store){
-        .read = read, .write = write, .getsize = getsize, .setsize = setsize};
+        .read        = read,
+        .write       = write,
+        .read_range  = read_range,
+        .write_range = write_range,
+        .getsize     = getsize,
+        .setsize     = setsize};
 
+    inode_intf cache = cache_init(&disk, CACHE_NBLOCKS);
     inode_intf fs =
-        (FILESYS == 0) ? mydisk_init(&disk, 0) : treedisk_init(&disk, 0);
+        (FILESYS == 0) ? mydisk_init(cache, 0) : treedisk_init(cache, 0);
+    cache_sync(cache);
+    bio_sync();
+    if (BIO_BENCH) bio_bench();
 
     /* Send a notification to GPID_PROCESS. */
     char buf[SYSCALL_MSG_LEN];
@@ -39,22 +377,44 @@ int main() {
     grass->sys_send(GPID_PROCESS, buf, 32);
 
     /* Wait for inode read or write requests. */
-    while (1) {
+    for (uint nrequests = 1;; nrequests++) {
         int sender, r;
+        uint offset, end;
         struct file_request* req = (void*)buf;
         struct file_reply* reply = (void*)buf;
         grass->sys_recv(GPID_ALL, &sender, buf, SYSCALL_MSG_LEN);
 
         switch (req->type) {
         case FILE_READ:
-            r = fs->read(fs, req->ino, req->offset, (void*)&reply->block);
-            reply->status = r == 0 ? FILE_OK : FILE_ERROR;
-            grass->sys_send(sender, (void*)reply, sizeof(*reply));
+            /* The replies are sent from another buffer, so req stays. */
+            r = stream_read(fs, sender, req->ino, req->offset, req->len);
+            cache_sync(cache);
+            bio_sync();
+            offset = req->offset / BLOCK_SIZE;
+            end    = (req->offset + req->len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (r == 0) readahead(fs, req->ino, offset, end - offset);
             break;
         case FILE_WRITE:
-            /* The FILE_WRITE case is left to students as an exercise. */
+            /* The blocks written are on the disk before the reply. */
+            dentry_invalidate(req->ino);
+            r = stream_write(fs, sender, req);
+            cache_sync(cache);
+            bio_sync();
+            reply->status = r == 0 ? FILE_OK : FILE_ERROR;
+            grass->sys_send(sender, (void*)reply,
+                            sizeof(*reply) - FILE_DATA_LEN);
+            break;
+        case FILE_LOOKUP:
+            req->data[FILE_DATA_LEN - 1] = 0;
+            r             = dentry_lookup(fs, req->ino, req->data);
+            reply->status = r < 0 ? FILE_ERROR : FILE_OK;
+            reply->ino    = r;
+            grass->sys_send(sender, (void*)reply,
+                            sizeof(*reply) - FILE_DATA_LEN);
+            break;
         default:
             FATAL("sys_file: invalid request %d", req->type);
         }
+        if (nrequests % CACHE_STATS_EVERY == 0) cache_stats(cache);
     }
 }
@@ -10,9 +10,13 @@
 #include "elf.h"
 #include "disk.h"
 
+#define PAGE_SIZE 4096
+
 static int app_ino, app_pid;
 static void sys_spawn(uint base);
+static void app_read(uint off, uint nblocks, char* dst);
 static int app_spawn(struct proc_request* req);
+static int app_mmap(int pid, uint vaddr, uint len);
 
 struct multicore {
     int boot_lock, booted_core_cnt; /* See earth/boot.s */
@@ -65,6 +69,20 @@ int main(int unused, struct multicore* boot) {
                 INFO("process %d running in the background", app_pid);
             grass->sys_send(GPID_SHELL, (void*)reply, sizeof(*reply));
             break;
+        case PROC_MMAP:
+            reply->type = app_mmap(sender, req->vaddr, req->argc);
+            grass->sys_send(sender, (void*)reply, sizeof(*reply));
+            break;
+        case PROC_PAGEIN:
+            /* The ELF file of the process is identified by the tag. */
+            app_ino = req->tag;
+            if (elf_pagein(sender, app_read, req->tag, req->vaddr) == 0) {
+                grass->sys_send(sender, (void*)reply, sizeof(*reply));
+                break;
+            }
+            INFO("process %d terminated with page fault at 0x%x", sender,
+                 req->vaddr);
+            /* Fall through and terminate the process. */
         case PROC_EXIT:
             grass->proc_free(sender);
 
@@ -94,7 +112,9 @@ int main(int unused, struct multicore* boot) {
     }
 }
 
-static void app_read(uint off, char* dst) { file_read(app_ino, off, dst); }
+static void app_read(uint off, uint nblocks, char* dst) {
+    file_pread(app_ino, off * BLOCK_SIZE, nblocks * BLOCK_SIZE, dst);
+}
 
 static int app_spawn(struct proc_request* req) {
     int bin_ino = dir_lookup(0, "bin/");
@@ -102,17 +122,31 @@ static int app_spawn(struct proc_request* req) {
     int argc = req->argv[req->argc - 1][0] == '&' ? req->argc - 1 : req->argc;
 
     app_pid = grass->proc_alloc();
-    elf_load(app_pid, app_read, argc, (void**)req->argv);
+    uint entry =
+        elf_load_lazy(app_pid, app_read, app_ino, argc, (void**)req->argv);
+    grass->proc_set_entry(app_pid, entry);
     grass->proc_set_ready(app_pid);
 
     return CMD_OK;
 }
 
+static int app_mmap(int pid, uint vaddr, uint len) {
+    /* Anonymous memory relies on page faults, like demand paging. */
+    if (earth->translation == SOFT_TLB || pid < GPID_USER_START ||
+        vaddr < APPS_MMAP_BASE || len > APPS_MMAP_END - vaddr)
+        return CMD_ERROR;
+
+    uint end_pageno = (vaddr + len + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (uint pageno = vaddr / PAGE_SIZE; pageno < end_pageno; pageno++)
+        earth->mmu_map_lazy(pid, pageno, 0);
+    return CMD_OK;
+}
+
 static int sys_apps_base;
 char* sys_apps[] = {"sys_process", "sys_terminal", "sys_file", "sys_shell"};
 
-static void sys_proc_read(uint block_no, char* dst) {
-    earth->disk_read(sys_apps_base + block_no, 1, dst);
+static void sys_proc_read(uint block_no, uint nblocks, char* dst) {
+    grass->sys_disk(sys_apps_base + block_no, nblocks, dst, 0);
 }
 
 static void sys_spawn(uint base) {
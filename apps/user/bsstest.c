@@ -0,0 +1,32 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: check .bss right after the data of the data segment
+ * With demand paging, the page holding the end of .data (and .rela.dyn)
+ * also holds the start of .bss, and is read from the file on the first
+ * access; its .bss part must be zero and writable.
+ */
+
+#include "app.h"
+
+#define PAGE_SIZE 4096
+
+int data[64] = {1, 2, 3};
+static char bss[2 * PAGE_SIZE];
+
+int main() {
+    /* Touch .bss first, so that its fault brings in the shared page. */
+    uint nonzero = 0;
+    for (uint i = 0; i < sizeof(bss); i++) nonzero += (bss[i] != 0);
+    for (uint i = 0; i < sizeof(bss); i++) bss[i] = i;
+    for (uint i = 0; i < sizeof(bss); i++) nonzero += (bss[i] != (char)i);
+
+    if (nonzero || data[0] != 1 || data[2] != 3) {
+        INFO("bsstest: .bss at 0x%x is wrong (%d bytes)", (uint)bss, nonzero);
+        return -1;
+    }
+    INFO("bsstest: .bss at 0x%x after .data at 0x%x is zero and writable",
+         (uint)bss, (uint)(data + 64));
+    return 0;
+}
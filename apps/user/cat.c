@@ -7,6 +7,10 @@
 
 #include "app.h"
 
+/* The file is read CAT_CHUNK bytes per request to the file server. */
+#define CAT_CHUNK 4096
+static char buf[CAT_CHUNK];
+
 int main(int argc, char** argv) {
     if (argc != 2) {
         INFO("usage: cat [FILE]");
@@ -20,11 +24,20 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    /* Read and print the first block of the inode. */
-    char buf[BLOCK_SIZE];
-    file_read(file_ino, 0, buf);
-    printf("%s", buf);
-    if (buf[strlen(buf) - 1] != '\n') printf("\n\r");
+    /* Print the file up to its first zero byte, which ends a text file. */
+    int n;
+    char last = '\n';
+    for (uint off = 0; (n = file_pread(file_ino, off, CAT_CHUNK, buf)) > 0;
+         off += n) {
+        uint len = 0;
+        while (len < n && buf[len]) len++;
+        for (uint i = 0; i < len; i += TERM_BUF_SIZE)
+            term_write(buf + i,
+                       len - i < TERM_BUF_SIZE ? len - i : TERM_BUF_SIZE);
+        if (len) last = buf[len - 1];
+        if (len < n) break;
+    }
+    if (last != '\n') printf("\n\r");
 
     return 0;
 }
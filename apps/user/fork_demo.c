@@ -0,0 +1,32 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: a simple demo of fork() with copy-on-write pages
+ * When the processes exit, the kernel prints the fork latency of the child
+ * and the spawn latency of the parent with their lifecycle statistics.
+ */
+
+#include "app.h"
+
+int main() {
+    volatile int counter = 2000;
+
+    int pid = sys_fork();
+    if (pid < 0) {
+        INFO("fork_demo: fork requires page table translation");
+        return -1;
+    }
+
+    if (pid == 0) {
+        /* The first write copies the stack page of the child. */
+        counter++;
+        printf("child: counter=%d\n\r", counter);
+        return 0;
+    }
+
+    /* Wait for the child, which should not change the counter of parent. */
+    for (uint i = 0; i < 1000000; i++);
+    printf("parent: child pid=%d, counter=%d\n\r", pid, counter);
+    return 0;
+}
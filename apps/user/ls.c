@@ -6,6 +6,11 @@
  */
 
 #include "app.h"
+#include "dir.h"
+
+#define LS_MAX_NBLOCKS 16
+static struct dir_block blocks[LS_MAX_NBLOCKS];
+static char* names[LS_MAX_NBLOCKS * DIR_ENTRIES_PER_BLOCK];
 
 int main(int argc, char** argv) {
     if (argc > 1) {
@@ -13,15 +18,25 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    /* Read the directory content. */
-    char buf[BLOCK_SIZE];
-    file_read(workdir_ino, 0, buf);
-
-    /* Remove the inode numbers from the string. */
-    for (uint i = 1; i < strlen(buf); i++)
-        if (buf[i - 1] == ' ' && buf[i] >= '0' && buf[i] <= '9') buf[i] = ' ';
+    /* Read the directory, a hash table described in library/file/dir.h. */
+    int n = file_pread(workdir_ino, 0, sizeof(blocks), (void*)blocks);
+    if (n < 0) {
+        INFO("ls: cannot read the directory");
+        return -1;
+    }
 
-    /* Print out the directory content. */
-    printf("%s\n\r", buf);
+    /* Sort the names with insertion sort and print them out. */
+    uint nnames = 0;
+    struct dir_entry* entries = (void*)blocks;
+    for (uint i = 0; i < n / sizeof(struct dir_entry); i++) {
+        char* name = entries[i].name;
+        if (name[0] == 0) continue;
+        uint j = nnames++;
+        for (; j > 0 && strcmp(names[j - 1], name) > 0; j--)
+            names[j] = names[j - 1];
+        names[j] = name;
+    }
+    for (uint i = 0; i < nnames; i++) printf("%s ", names[i]);
+    printf("\n\r");
     return 0;
 }
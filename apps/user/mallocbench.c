@@ -0,0 +1,38 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: a microbenchmark of malloc() and free()
+ * Compare the CPU time printed by the kernel when mallocbench exits with
+ * the one of a build using the C library's malloc() (make MALLOC=newlib).
+ */
+
+#include "app.h"
+#include <stdlib.h>
+#include <malloc.h>
+
+#define NLIVE 256
+
+int main(int argc, char** argv) {
+    uint nrounds = (argc == 2) ? atoi(argv[1]) : 100;
+    void* live[NLIVE] = {0};
+
+    /* Round 1: short-lived small objects, e.g., messages and strings. */
+    for (uint i = 0; i < nrounds * 1000; i++) free(malloc(16 + i % 48));
+
+    /* Round 2: a set of live objects of mixed sizes replaced at random. */
+    uint seed = 2000;
+    for (uint i = 0; i < nrounds * 1000; i++) {
+        seed      = seed * 1103515245 + 12345;
+        uint slot = (seed >> 16) % NLIVE;
+        free(live[slot]);
+        live[slot] = malloc((seed >> 8) % 4 ? (seed >> 4) % 512 : 4096);
+    }
+    for (uint i = 0; i < NLIVE; i++) free(live[i]);
+
+    INFO("mallocbench: %d malloc/free pairs", nrounds * 2000);
+#ifndef MALLOC_NEWLIB
+    malloc_stats();
+#endif
+    return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: measure memcpy, memset and memcmp in bytes per cycle
+ * The numbers are printed in hundredths, e.g., 250 means 2.5 bytes/cycle.
+ */
+
+#include "app.h"
+#include <string.h>
+
+static uint cycles() {
+    uint cycle;
+    asm volatile("csrr %0, cycle" : "=r"(cycle));
+    return cycle;
+}
+
+static char src[4096 + 8] __attribute__((aligned(4096)));
+static char dst[4096 + 8] __attribute__((aligned(4096)));
+uint sizes[] = {16, 128, 512, 1024, 4096};
+
+#define MEASURE(fn, size, args)                                                \
+    ({                                                                         \
+        uint start = cycles();                                                 \
+        for (uint k = 0; k < nrounds; k++) fn args;                            \
+        uint spent = cycles() - start;                                         \
+        spent ? (int)((ulonglong)size * nrounds * 100 / spent) : 0;            \
+    })
+
+int main(int argc, char** argv) {
+    uint nrounds = 64;
+    memset(src, 1, sizeof(src));
+    memset(dst, 1, sizeof(dst));
+
+    printf("size   memcpy  memcpy+1  memset  memcmp  (bytes/cycle x100)\n\r");
+    for (uint i = 0; i < sizeof(sizes) / sizeof(uint); i++) {
+        uint n = sizes[i];
+        printf("%d\t%d\t%d\t%d\t%d\n\r", n, MEASURE(memcpy, n, (dst, src, n)),
+               MEASURE(memcpy, n, (dst, src + 1, n)),
+               MEASURE(memset, n, (dst, 0, n)),
+               MEASURE(memcmp, n, (dst, dst, n)));
+    }
+    printf("page   copy    zero    diff\n\r");
+    printf("4096\t%d\t%d\t%d\n\r", MEASURE(page_copy, 4096, (dst, src)),
+           MEASURE(page_zero, 4096, (dst)), MEASURE(page_diff, 4096, (dst, dst)));
+    return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: touch [npages] pages of heap memory and keep them
+ * Running "memhog 400 &" leaves the free page pool nearly full, so the
+ * spawn and exit latency printed by the kernel for other commands shows
+ * the allocator cost when free pages are scarce; killall releases them.
+ */
+
+#include "app.h"
+#include <stdlib.h>
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        INFO("usage: memhog [npages]");
+        return -1;
+    }
+
+    int npages = atoi(argv[1]);
+    char* mem  = malloc(npages * 4096);
+    for (uint i = 0; i < npages; i++) mem[i * 4096] = 1;
+    INFO("memhog: holding %d pages", npages);
+
+    while (1);
+}
@@ -0,0 +1,58 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: measure sequential file reads
+ * Read a file in /bin block by block twice: the first pass shows the
+ * readahead of sys_file and the second its cache. The third pass reads as
+ * many blocks at random offsets of the file, and the last one reads the file
+ * BULK_LEN bytes per request with file_pread(), as cat and the ELF loader do.
+ */
+
+#include "app.h"
+
+#define BULK_LEN 8192
+static char bulk[BULK_LEN];
+
+static uint cycles() {
+    uint cycle;
+    asm volatile("csrr %0, cycle" : "=r"(cycle));
+    return cycle;
+}
+
+int main(int argc, char** argv) {
+    char* name  = (argc == 2) ? argv[1] : "readbench";
+    int bin_ino = dir_lookup(0, "bin/");
+    int ino     = dir_lookup(bin_ino, name);
+    if (ino < 0) {
+        INFO("readbench: file %s not found", name);
+        return -1;
+    }
+
+    char buf[BLOCK_SIZE];
+    uint nblocks, spent, seed = 1;
+    for (uint pass = 1; pass <= 3; pass++) {
+        uint start = cycles();
+        if (pass < 3) {
+            for (nblocks = 0; file_read(ino, nblocks, buf) == 0;) nblocks++;
+        } else {
+            for (uint i = 0; i < nblocks; i++) {
+                seed = seed * 1103515245 + 12345;
+                file_read(ino, (seed >> 16) % nblocks, buf);
+            }
+        }
+        spent = cycles() - start;
+        printf("%s: %d blocks in %d kcycles, %d cycles per block\n\r",
+               pass < 3 ? "sequential" : "random", nblocks, spent / 1000,
+               nblocks ? spent / nblocks : 0);
+    }
+
+    int n;
+    uint start = cycles();
+    for (uint off = 0; (n = file_pread(ino, off, BULK_LEN, bulk)) > 0;)
+        off += n;
+    spent = cycles() - start;
+    printf("bulk: %d blocks in %d kcycles, %d cycles per block\n\r", nblocks,
+           spent / 1000, nblocks ? spent / nblocks : 0);
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: check that pages are swapped out when memory is full
+ * Touch [npages] heap pages, 768 by default, which is more than the 512
+ * pages of [APPS_PAGES_BASE, RAM_END), with a pattern in each page, and read
+ * the pattern back twice; the kernel swaps pages out and in on the way
+ * instead of failing with "no more free memory".
+ */
+
+#include "app.h"
+#include <stdlib.h>
+
+#define PAGE_SIZE 4096
+
+int main(int argc, char** argv) {
+    int npages = (argc == 2) ? atoi(argv[1]) : 768;
+    uint* mem  = malloc(npages * PAGE_SIZE);
+    if (mem == NULL) {
+        INFO("swaptest: cannot allocate %d pages", npages);
+        return -1;
+    }
+
+    for (uint i = 0; i < npages; i++) {
+        mem[i * PAGE_SIZE / 4]           = i;
+        mem[(i + 1) * PAGE_SIZE / 4 - 1] = ~i;
+    }
+
+    uint nerrors = 0;
+    for (uint round = 0; round < 2; round++)
+        for (uint i = 0; i < npages; i++)
+            if (mem[i * PAGE_SIZE / 4] != i ||
+                mem[(i + 1) * PAGE_SIZE / 4 - 1] != ~i)
+                nerrors++;
+
+    if (nerrors) {
+        INFO("swaptest: %d pages read back wrong", nerrors);
+        return -1;
+    }
+    INFO("swaptest: %d pages written and read back", npages);
+    free(mem);
+    return 0;
+}
@@ -32,10 +32,38 @@ static void timer_reset(uint core_id) {
     mtimecmp_set(mtime_get() + QUANTUM, core_id);
 }
 
+/* The PLIC has a context for the machine mode of each core at 2 * core_id on
+ * QEMU. PCI interrupt pin INTA of slot s is IRQ 32 + s % 4, and the SD card
+ * controller is in slot 1 (see QEMU_SD_CARD in Makefile). */
+#define PLIC_PRIORITY(irq)      (PLIC_BASE + 4 * (irq))
+#define PLIC_ENABLE(core_id)    (PLIC_BASE + 0x2000 + 0x80 * 2 * (core_id))
+#define PLIC_THRESHOLD(core_id) (PLIC_BASE + 0x200000 + 0x1000 * 2 * (core_id))
+#define PLIC_CLAIM(core_id)     (PLIC_THRESHOLD(core_id) + 4)
+#define SDHCI_IRQ               33
+
+static uint intr_claim(uint core_id) {
+    return REGW(PLIC_CLAIM(core_id), 0);
+}
+
+static void intr_complete(uint core_id, uint irq) {
+    REGW(PLIC_CLAIM(core_id), 0) = irq;
+}
+
+static void plic_init(uint core_id) {
+    /* Let the SD card interrupt any core when a disk transfer completes. */
+    if (earth->platform != QEMU) return;
+    REGW(PLIC_PRIORITY(SDHCI_IRQ), 0) = 1;
+    REGW(PLIC_ENABLE(core_id), SDHCI_IRQ / 32 * 4) |= 1 << (SDHCI_IRQ % 32);
+    REGW(PLIC_THRESHOLD(core_id), 0) = 0;
+    asm("csrs mie, %0" ::"r"(0x800));
+}
+
 void trap_entry(); /* See grass/kernel.s */
 void intr_init(uint core_id) {
     /* Initialize the timer. */
-    earth->timer_reset = timer_reset;
+    earth->timer_reset   = timer_reset;
+    earth->intr_claim    = intr_claim;
+    earth->intr_complete = intr_complete;
     mtimecmp_set(0x0FFFFFFFFFFFFFFFUL, core_id);
 
     /* Setup the interrupt/exception handling entry. */
@@ -45,7 +73,13 @@ void intr_init(uint core_id) {
     /* Enable timer interrupt. */
     asm("csrw mip, %0" ::"r"(0));
     asm("csrs mie, %0" ::"r"(0x80));
+    /* Enable software interrupt for TLB shootdowns (see cpu_mmu.c). */
+    asm("csrs mie, %0" ::"r"(0x8));
+    /* Let apps read the cycle counter (see apps/user/membench.c). */
+    asm("csrw mcounteren, %0" ::"r"(0x7));
     asm("csrs mstatus, %0" ::"r"(0x88));
+    /* Enable external interrupts from the SD card (see earth/dev_disk.c). */
+    plic_init(core_id);
 
     /* Student's code goes here (Ethernet & TCP/IP). */
 
@@ -67,5 +101,11 @@ void post_boot_intr_init(uint core_id) {
     // /* Enable timer interrupt. */
     asm("csrw mip, %0" ::"r"(0));
     asm("csrs mie, %0" ::"r"(0x80));
+    /* Enable software interrupt for TLB shootdowns (see cpu_mmu.c). */
+    asm("csrs mie, %0" ::"r"(0x8));
+    /* Let apps read the cycle counter (see apps/user/membench.c). */
+    asm("csrw mcounteren, %0" ::"r"(0x7));
     asm("csrs mstatus, %0" ::"r"(0x88));
+    /* Enable external interrupts from the SD card (see earth/dev_disk.c). */
+    plic_init(core_id);
 }
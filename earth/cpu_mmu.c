@@ -8,66 +8,286 @@
  */
 
 #include "egos.h"
+#include "disk.h"
 #include <string.h>
 #include <servers.h>
 
 #define PAGE_SIZE          4096
 #define PAGE_NO_TO_ADDR(x) (char*)(x * PAGE_SIZE)
 #define PAGE_ID_TO_ADDR(x) ((char*)APPS_PAGES_BASE + x * PAGE_SIZE)
-#define APPS_PAGES_CNT     (RAM_END - APPS_PAGES_BASE) / PAGE_SIZE
+#define ADDR_TO_PAGE_ID(x) (((uint)(x) - APPS_PAGES_BASE) / PAGE_SIZE)
+#define APPS_PAGES_CNT     ((RAM_END - APPS_PAGES_BASE) / PAGE_SIZE)
+
+#define MAX_NPROCESS       256
+/* Assume at most MAX_NPROCESS unique processes just for simplicity. */
 
 struct page_info {
-    int use;
+    int use; /* number of address spaces mapping this page (0 means free) */
     int pid;
     uint vpage_no;
+    int next; /* next page on the owner list of pid, or -1 */
 } page_info_table[APPS_PAGES_CNT];
 
-uint mmu_alloc() {
-    for (uint i = 0; i < APPS_PAGES_CNT; i++)
-        if (!page_info_table[i].use) {
-            page_info_table[i].use = 1;
-            return i;
+/* Free memory is managed by a buddy allocator. A free block of 2^order pages
+ * is bit (ppage_id >> order) in free_map[order], and bit i of
+ * free_summary[order] tells whether free_map[order][i] has any free block,
+ * so a free block is found with two find-first-set operations instead of
+ * scanning page_info_table. Initially, the whole region is one free block. */
+#define MAX_ORDER      9 /* 2^9 pages, i.e., [APPS_PAGES_BASE, RAM_END) */
+#define FREE_MAP_WORDS (APPS_PAGES_CNT / 32)
+static uint free_map[MAX_ORDER + 1][FREE_MAP_WORDS] = {[MAX_ORDER] = {1}};
+static uint free_summary[MAX_ORDER + 1]             = {[MAX_ORDER] = 1};
+
+/* The pages released by mmu_free(pid) are on the owner list of pid; these are
+ * the page tables with page table translation and all pages otherwise. */
+static int owner_list[MAX_NPROCESS] = {[0 ... MAX_NPROCESS - 1] = -1};
+
+static void block_put(uint order, uint block) {
+    free_map[order][block / 32] |= 1 << (block % 32);
+    free_summary[order] |= 1 << (block / 32);
+}
+
+static int block_take(uint order, uint block) {
+    /* Remove block from free_map[order], or return 0 if it is not free. */
+    uint* word = &free_map[order][block / 32];
+    if (!(*word & (1 << (block % 32)))) return 0;
+    *word &= ~(1 << (block % 32));
+    if (!*word) free_summary[order] &= ~(1 << (block / 32));
+    return 1;
+}
+
+static int mmu_in_kernel() {
+    /* The kernel runs on the egos stack, below any process stack. */
+    uint sp;
+    asm("mv %0, sp" : "=r"(sp));
+    return sp <= EGOS_STACK_TOP;
+}
+
+static uint zero_pool_drain();
+static int swap_out();
+
+uint mmu_alloc_pages(uint order) {
+    /* Take the smallest free block with at least 2^order pages; when memory
+     * runs out, free the zero pool or swap out a cold page and try again. */
+    uint curr = order;
+    while (curr <= MAX_ORDER && !free_summary[curr]) curr++;
+    if (curr > MAX_ORDER && (zero_pool_drain() || swap_out()))
+        return mmu_alloc_pages(order);
+    if (curr > MAX_ORDER) FATAL("mmu_alloc: no more free memory");
+
+    uint word  = __builtin_ctz(free_summary[curr]);
+    uint block = word * 32 + __builtin_ctz(free_map[curr][word]);
+    block_take(curr, block);
+
+    /* Split the block and keep the upper halves free. */
+    for (; curr > order; curr--) {
+        block *= 2;
+        block_put(curr - 1, block + 1);
+    }
+
+    uint ppage_id = block << order;
+    for (uint i = 0; i < (1 << order); i++)
+        page_info_table[ppage_id + i].use = 1;
+    return ppage_id;
+}
+
+void mmu_free_pages(uint ppage_id, uint order) {
+    memset(&page_info_table[ppage_id], 0,
+           sizeof(struct page_info) << order);
+
+    /* Merge the block with its buddy as long as the buddy is free. */
+    uint block = ppage_id >> order;
+    for (; order < MAX_ORDER && block_take(order, block ^ 1); order++)
+        block /= 2;
+    block_put(order, block);
+}
+
+uint mmu_alloc() { return mmu_alloc_pages(0); }
+
+/* Released pages go to zero_pool, and idle cores zero them in mmu_zero_idle()
+ * without the kernel lock, so mmu_alloc_zeroed() seldom clears a page on the
+ * critical path. A slot holds 0 (empty) or 1 + the id of a page, with
+ * ZERO_BUSY while a core is zeroing it and ZERO_READY once it is zeroed. */
+#define ZERO_POOL_SIZE 16
+#define ZERO_BUSY      (1 << 30)
+#define ZERO_READY     (1 << 31)
+#define ZERO_PAGE_ID(x) (((x) & 0xFFFF) - 1)
+static uint zero_pool[ZERO_POOL_SIZE];
+static uint zero_pool_hits, zero_pool_misses;
+
+uint mmu_alloc_zeroed() {
+    for (uint i = 0; i < ZERO_POOL_SIZE; i++) {
+        uint slot = zero_pool[i];
+        if ((slot & ZERO_READY) &&
+            __sync_bool_compare_and_swap(&zero_pool[i], slot, 0)) {
+            zero_pool_hits++;
+            page_info_table[ZERO_PAGE_ID(slot)].use = 1;
+            return ZERO_PAGE_ID(slot);
         }
-    FATAL("mmu_alloc: no more free memory");
+    }
+    zero_pool_misses++;
+    uint ppage_id = mmu_alloc();
+    page_zero(PAGE_ID_TO_ADDR(ppage_id));
+    return ppage_id;
 }
 
-void mmu_free(int pid) {
+void mmu_zero_idle() {
+    for (uint i = 0; i < ZERO_POOL_SIZE; i++) {
+        uint slot = zero_pool[i];
+        if (!slot || (slot & (ZERO_BUSY | ZERO_READY)) ||
+            !__sync_bool_compare_and_swap(&zero_pool[i], slot, slot | ZERO_BUSY))
+            continue;
+        page_zero(PAGE_ID_TO_ADDR(ZERO_PAGE_ID(slot)));
+        __sync_lock_test_and_set(&zero_pool[i], slot | ZERO_READY);
+    }
+}
+
+static uint zero_pool_drain() {
+    /* Give the pages in zero_pool back when memory runs out. */
+    uint count = 0;
+    for (uint i = 0; i < ZERO_POOL_SIZE; i++) {
+        uint slot = zero_pool[i];
+        if (!slot || (slot & ZERO_BUSY) ||
+            !__sync_bool_compare_and_swap(&zero_pool[i], slot, 0))
+            continue;
+        mmu_free_pages(ZERO_PAGE_ID(slot), 0);
+        count++;
+    }
+    return count;
+}
+
+static void page_release(uint ppage_id) {
+    memset(&page_info_table[ppage_id], 0, sizeof(struct page_info));
+    for (uint i = 0; i < ZERO_POOL_SIZE; i++)
+        if (__sync_bool_compare_and_swap(&zero_pool[i], 0, ppage_id + 1))
+            return;
+    mmu_free_pages(ppage_id, 0);
+}
+
+static void swap_stats();
+
+static void mmu_frag_stats() {
+    /* Fragmentation is the share of free pages outside the largest block. */
+    uint free_pages = 0, largest = 0;
+    for (uint order = 0; order <= MAX_ORDER; order++)
+        for (uint i = 0; i < FREE_MAP_WORDS; i++) {
+            uint nblocks = __builtin_popcount(free_map[order][i]);
+            free_pages += nblocks << order;
+            if (nblocks) largest = 1 << order;
+        }
+    INFO("%d free pages, the largest free block has %d pages (%d%% fragmented)",
+         free_pages, largest,
+         free_pages ? (free_pages - largest) * 100 / free_pages : 0);
+
+    uint allocs = zero_pool_hits + zero_pool_misses;
+    INFO("%d of %d zeroed pages came from the pool (%d%% hit rate)",
+         zero_pool_hits, allocs, allocs ? zero_pool_hits * 100 / allocs : 0);
+    swap_stats();
+}
+
+static void page_own(uint ppage_id, int pid) {
+    if (pid >= MAX_NPROCESS) FATAL("page_own: pid too large");
+    page_info_table[ppage_id].pid  = pid;
+    page_info_table[ppage_id].next = owner_list[pid];
+    owner_list[pid]                = ppage_id;
+}
+
+static int page_put(uint ppage_id) {
+    /* Drop one reference and release the page when nobody maps it anymore. */
+    if (--page_info_table[ppage_id].use) return 0;
+    page_release(ppage_id);
+    return 1;
+}
+
+static int page_table_release_later(int pid);
+static int page_table_release(int pid, int* saved_count);
+static void mmu_shootdown_stats();
+static void soft_tlb_unmap(uint ppage_id);
+
+static void mmu_free_now(int pid) {
     int page_count = 0;
     int page_table_count = 0;
-    for (uint i = 0; i < APPS_PAGES_CNT; i++)
-        if (page_info_table[i].use && page_info_table[i].pid == pid) {
-            if (page_info_table[i].vpage_no == 0)  {
-                page_table_count++;
-            }
-            
-            memset(&page_info_table[i], 0, sizeof(struct page_info));
-            page_count++;
-        }
-    INFO("mmu_free released %d pages (%d are page tables) for process %d", page_count, page_table_count, pid);
+    int saved_count = 0;
+
+    /* With page tables, data pages may be shared copy-on-write by several
+     * processes, so they are released by walking the page tables of pid. */
+    if (earth->translation == PAGE_TABLE)
+        page_count = page_table_release(pid, &saved_count);
+
+    for (int i = owner_list[pid], next; i != -1; i = next) {
+        next = page_info_table[i].next;
+        if (page_info_table[i].vpage_no == 0) page_table_count++;
+        if (earth->translation == SOFT_TLB) soft_tlb_unmap(i);
+        page_release(i);
+        page_count++;
+    }
+    owner_list[pid] = -1;
+    INFO("mmu_free released %d pages (%d are page tables, %d saved by megapages or sharing) for process %d", page_count, page_table_count, saved_count, pid);
+    mmu_frag_stats();
+    mmu_shootdown_stats();
+}
+
+void mmu_free(int pid) {
+    /* A pid too large for owner_list owns no page (see page_own). */
+    if (pid >= MAX_NPROCESS) return;
+
+    /* Other cores may still run pid (e.g., spinning in exit()), and then
+     * mmu_shootdown() releases the pages once they have flushed their TLBs. */
+    if (earth->translation == PAGE_TABLE && page_table_release_later(pid))
+        return;
+    mmu_free_now(pid);
 }
 
+/* The software TLB leaves the pages of a process in the apps region after
+ * switching away, so soft_tlb_resident[slot] is 1 + the id of the page whose
+ * content is at the slot-th page of the apps region (or 0). A page is copied
+ * in only if another page took its slot, and copied back only if changed.
+ * The heap of a process is not mapped page by page (see _sbrk), and may
+ * cover the slots of other processes, so only the pages of the process
+ * switched to stay resident while it runs. */
+#define APPS_REGION_PAGES ((APPS_PAGES_BASE - APPS_ENTRY) / PAGE_SIZE)
+#define VPAGE_TO_SLOT(x)  ((x) - APPS_ENTRY / PAGE_SIZE)
+static uint soft_tlb_resident[APPS_REGION_PAGES];
+
 void soft_tlb_map(int pid, uint vpage_no, uint ppage_id) {
-    page_info_table[ppage_id].pid      = pid;
+    if (VPAGE_TO_SLOT(vpage_no) >= APPS_REGION_PAGES)
+        FATAL("soft_tlb_map: vpage 0x%x is not in the apps region", vpage_no);
+    page_own(ppage_id, pid);
     page_info_table[ppage_id].vpage_no = vpage_no;
 }
 
-void soft_tlb_switch(int pid) {
-    static int curr_vm_pid = -1;
-    if (pid == curr_vm_pid) return;
+static void soft_tlb_unmap(uint ppage_id) {
+    uint slot = VPAGE_TO_SLOT(page_info_table[ppage_id].vpage_no);
+    if (soft_tlb_resident[slot] == ppage_id + 1) soft_tlb_resident[slot] = 0;
+}
 
-    /* Unmap curr_vm_pid from the user address space. */
-    for (uint i = 0; i < APPS_PAGES_CNT; i++)
-        if (page_info_table[i].use && page_info_table[i].pid == curr_vm_pid)
-            memcpy(PAGE_ID_TO_ADDR(i),
-                   PAGE_NO_TO_ADDR(page_info_table[i].vpage_no), PAGE_SIZE);
+static void soft_tlb_evict(uint slot) {
+    /* Copy the page back from its first modified word, if any. */
+    char* src = (char*)(APPS_ENTRY + slot * PAGE_SIZE);
+    char* dst = PAGE_ID_TO_ADDR(soft_tlb_resident[slot] - 1);
+    uint off  = page_diff(src, dst);
+    if (off < PAGE_SIZE) memcpy(dst + off, src + off, PAGE_SIZE - off);
+    soft_tlb_resident[slot] = 0;
+}
 
-    /* Map pid to the user address space. */
-    for (uint i = 0; i < APPS_PAGES_CNT; i++)
-        if (page_info_table[i].use && page_info_table[i].pid == pid)
-            memcpy(PAGE_NO_TO_ADDR(page_info_table[i].vpage_no),
-                   PAGE_ID_TO_ADDR(i), PAGE_SIZE);
+void soft_tlb_switch(int pid) {
+    if (pid >= MAX_NPROCESS) FATAL("soft_tlb_switch: pid too large");
+    for (uint slot = 0; slot < APPS_REGION_PAGES; slot++)
+        if (soft_tlb_resident[slot] &&
+            page_info_table[soft_tlb_resident[slot] - 1].pid != pid)
+            soft_tlb_evict(slot);
+
+    int copied = 0;
+    for (int i = owner_list[pid]; i != -1; i = page_info_table[i].next) {
+        uint vpage_no = page_info_table[i].vpage_no;
+        uint slot     = VPAGE_TO_SLOT(vpage_no);
+        if (soft_tlb_resident[slot] == i + 1) continue;
 
-    curr_vm_pid = pid;
+        page_copy(PAGE_NO_TO_ADDR(vpage_no), PAGE_ID_TO_ADDR(i));
+        soft_tlb_resident[slot] = i + 1;
+        copied++;
+    }
+    if (copied) earth->mmu_flush_cache();
 }
 
 uint soft_tlb_translate(int pid, uint vaddr) {
@@ -75,31 +295,173 @@ uint soft_tlb_translate(int pid, uint vaddr) {
     return vaddr;
 }
 
+/* The software TLB copies whole address spaces, so pages cannot be shared
+ * copy-on-write and any fault is a real fault (e.g., a null pointer). */
+int soft_tlb_fork(int src_pid, int dst_pid) { return -1; }
+
+void soft_tlb_map_zero(int pid, uint vpage_no) {
+    uint ppage_id = mmu_alloc_zeroed();
+    soft_tlb_map(pid, vpage_no, ppage_id);
+}
+
+void soft_tlb_map_lazy(int pid, uint vpage_no, uint tag) {
+    FATAL("soft_tlb_map_lazy: demand paging requires page tables");
+}
+
+int soft_tlb_fault(int pid, uint vaddr, uint mcause) { return -1; }
+
 /* The code below creates an identity map using page tables (RISC-V Sv32). */
 #define SUPERVISOR_RWX (0x1F);
 #define USER_RWX     (0xC0 | 0x1F)
-#define MAX_NPROCESS 256
+#define PTE_V        0x1
+#define PTE_W        0x4
+#define PTE_OWNED    (1 << 8) /* RSW bit: page from mmu_alloc, not identity */
+#define PTE_COW      (1 << 9) /* RSW bit: write-protected copy-on-write page */
+#define PTE_LAZY     (1 << 1) /* with PTE_V clear: a page for the pager to load */
+#define PTE_SWAP     (1 << 2) /* with PTE_V clear: a page in the swap area */
+#define PTE_A        0x40
+#define PTE_TO_ADDR(x) ((uint*)((x << 2) & 0xFFFFF000))
+#define PTE_IS_LEAF(x) (((x) & PTE_V) && ((x) & 0xE)) /* R, W or X bit set */
 static uint* root;
 static uint* leaf;
 static uint* pid_to_pagetable_base[MAX_NPROCESS];
-/* Assume at most MAX_NPROCESS unique processes just for simplicity. */
+
+/* An address space is tagged with an ASID in satp, so switching does not
+ * flush the TLB. ASIDs are handed out in generations: when they run out, a
+ * new generation starts and every core flushes its whole TLB once before
+ * using an ASID of the new generation. If the CPU has no ASID bits,
+ * asid_max is 0 and every switch starts a new generation, i.e., flushes. */
+#define NCORES 4
+static uint asid_max, asid_next = 1, asid_generation = 1;
+static uint pid_to_asid[MAX_NPROCESS]; /* generation << 9 | asid */
+static uint pid_stale_cores[MAX_NPROCESS]; /* cores to flush for pid */
+static uint core_generation[NCORES];
+static int core_pid[NCORES] = {-1, -1, -1, -1};
+
+/* A core which is running pid keeps the old entries of pid in its TLB until
+ * it switches again, so page_table_changed() also adds it to shootdown_cores.
+ * The requests are batched and sent by shootdown_send() as one software
+ * interrupt (CLINT msip) per core, and mmu_shootdown() handles it. */
+#define MSIP_BASE CLINT_BASE
+ulonglong mtime_get();
+static uint shootdown_cores, shootdown_requests, shootdown_sent;
+static uint shootdown_flush_all; /* cores whose process was released */
+static uint pid_release_cores[MAX_NPROCESS]; /* cores to flush before the
+                                                pages of pid are released */
+static ulonglong shootdown_time[NCORES], shootdown_total, shootdown_max;
+
+static void page_table_changed(int pid) {
+    /* Any core may cache the old page table entries of pid. */
+    pid_stale_cores[pid] = (1 << NCORES) - 1;
+    for (uint i = 0; i < NCORES; i++)
+        if (core_pid[i] == pid) {
+            __sync_fetch_and_or(&shootdown_cores, 1 << i);
+            shootdown_requests++;
+        }
+}
+
+static void shootdown_send(uint core_id) {
+    /* This core flushes by itself when it switches to the next process. */
+    uint cores = __sync_fetch_and_and(&shootdown_cores, 1 << core_id);
+    cores &= ~(1 << core_id);
+    for (uint i = 0; i < NCORES; i++) {
+        if (!(cores & (1 << i))) continue;
+        shootdown_time[i] = mtime_get();
+        shootdown_sent++;
+        REGW(MSIP_BASE, i * 4) = 1;
+    }
+}
+
+void mmu_shootdown() {
+    /* Flush the entries of the process running on this core if stale. */
+    uint core_id;
+    asm("csrr %0, mhartid" : "=r"(core_id));
+    REGW(MSIP_BASE, core_id * 4) = 0;
+
+    int pid = core_pid[core_id];
+    uint bit = 1 << core_id;
+    if (__sync_fetch_and_and(&shootdown_flush_all, ~bit) & bit) {
+        /* Flush everything for the released processes, and release the pages
+         * of those that no other core has to flush anymore. */
+        asm("sfence.vma zero,zero");
+        for (uint i = 0; i < MAX_NPROCESS; i++) {
+            if (!(pid_release_cores[i] & bit)) continue;
+            if (core_pid[core_id] == i) core_pid[core_id] = -1;
+            pid_release_cores[i] &= ~bit;
+            if (!pid_release_cores[i]) mmu_free_now(i);
+        }
+    } else if (pid >= 0 && (pid_stale_cores[pid] & (1 << core_id))) {
+        if (asid_max)
+            asm("sfence.vma zero,%0" ::"r"(pid_to_asid[pid] & 0x1FF));
+        else
+            asm("sfence.vma zero,zero");
+        pid_stale_cores[pid] &= ~(1 << core_id);
+    }
+
+    ulonglong latency = mtime_get() - shootdown_time[core_id];
+    shootdown_total += latency;
+    if (latency > shootdown_max) shootdown_max = latency;
+}
+
+static void mmu_shootdown_stats() {
+    if (!shootdown_sent) return;
+    INFO("%d TLB shootdowns for %d requests, %dus on average and %dus at most",
+         shootdown_sent, shootdown_requests,
+         (int)(shootdown_total / shootdown_sent), (int)shootdown_max);
+}
+
+static uint page_table_asid(int pid) {
+    if ((pid_to_asid[pid] >> 9) != asid_generation) {
+        if (asid_next > asid_max) {
+            asid_generation++;
+            asid_next = 1;
+        }
+        pid_to_asid[pid] = (asid_generation << 9) | asid_next++;
+    }
+    return pid_to_asid[pid] & 0x1FF;
+}
+
+static uint* page_table_alloc(int pid) {
+    /* Allocate an empty page table on the owner list of pid. */
+    uint ppage_id = mmu_alloc_zeroed();
+    page_own(ppage_id, pid);
+    return (void*)PAGE_ID_TO_ADDR(ppage_id);
+}
+
+#define PTE_IS_SHARED(x, owner) \
+    (page_info_table[ADDR_TO_PAGE_ID(PTE_TO_ADDR(x))].pid != (owner))
+
+static uint* page_table_leaf(int pid, uint vpn1) {
+    /* Return the leaf table of root[vpn1], allocating it if necessary; a
+     * megapage is split into 1024 pages with the same permission, and a
+     * leaf table shared with the kernel is copied before it is changed. */
+    uint pte = root[vpn1];
+    if ((pte & PTE_V) && !PTE_IS_LEAF(pte) && !PTE_IS_SHARED(pte, pid))
+        return PTE_TO_ADDR(pte);
+
+    uint* table = page_table_alloc(pid);
+    if (PTE_IS_LEAF(pte))
+        for (uint i = 0; i < 1024; i++) table[i] = pte + (i << 10);
+    else if (pte & PTE_V)
+        page_copy(table, PTE_TO_ADDR(pte));
+    root[vpn1] = ((uint)table >> 2) | PTE_V;
+    return table;
+}
 
 void setup_identity_region(int pid, uint addr, uint npages, uint flag) {
     uint vpn1 = addr >> 22;
 
-    if (root[vpn1] & 0x1) {
-        /* Leaf has been allocated. */
-        leaf = (void*)((root[vpn1] << 2) & 0xFFFFF000);
-    } else {
-        /* Allocate the leaf page table. */
-        uint ppage_id                 = earth->mmu_alloc();
-        leaf                          = (void*)PAGE_ID_TO_ADDR(ppage_id);
-        page_info_table[ppage_id].pid = pid;
-        memset(leaf, 0, PAGE_SIZE);
-        root[vpn1] = ((uint)leaf >> 2) | 0x1;
+    /* An aligned 4MB region is a megapage in the root page table, which saves
+     * a leaf table and takes a single TLB entry. */
+    if (npages == 1024 && !(addr & 0x3FFFFF) && !(root[vpn1] & PTE_V)) {
+        root[vpn1] = (addr >> 2) | flag;
+        return;
     }
+    /* The region may be inside a megapage with the same permission. */
+    if (PTE_IS_LEAF(root[vpn1]) && (root[vpn1] & 0x3FF) == flag) return;
 
     /* Setup the entries in the leaf page table. */
+    leaf      = page_table_leaf(pid, vpn1);
     uint vpn0 = (addr >> 12) & 0x3FF;
     for (uint i = 0; i < npages; i++)
         leaf[vpn0 + i] = ((addr + i * PAGE_SIZE) >> 2) | flag;
@@ -107,11 +469,8 @@ void setup_identity_region(int pid, uint addr, uint npages, uint flag) {
 
 void pagetable_identity_map(int pid) {
     /* Allocate the root page table. */
-    uint ppage_id                 = earth->mmu_alloc();
-    root                          = (void*)PAGE_ID_TO_ADDR(ppage_id);
-    page_info_table[ppage_id].pid = pid;
-    pid_to_pagetable_base[pid]    = root;
-    memset(root, 0, PAGE_SIZE);
+    root                       = page_table_alloc(pid);
+    pid_to_pagetable_base[pid] = root;
 
     /* Setup the identity map for various memory regions. */
     for (uint i = RAM_START; i < RAM_END; i += PAGE_SIZE * 1024)
@@ -135,9 +494,38 @@ void pagetable_identity_map(int pid) {
     }
 }
 
-void page_table_map(int pid, uint vpage_no, uint ppage_id) {
+static uint* page_table_entry(int pid, uint vpage_no) {
+    /* Build the page tables of pid if necessary and return the leaf PTE. */
     if (pid >= MAX_NPROCESS) FATAL("page_table_map: pid too large");
 
+    // If page tables to not exist, build them
+    if (!pid_to_pagetable_base[pid]) {
+        if (pid < GPID_USER_START) {
+            /* Share the identity map built for the kernel by mmu_init, so
+             * only the leaf tables which pid changes become private. */
+            root                       = page_table_alloc(pid);
+            pid_to_pagetable_base[pid] = root;
+            page_copy(root, pid_to_pagetable_base[0]);
+        } else {
+            /* Allocate the root page table. */
+            root                       = page_table_alloc(pid);
+            pid_to_pagetable_base[pid] = root;
+
+            setup_identity_region(pid, SHELL_WORK_DIR, 1, USER_RWX);
+        }
+    }
+
+    // 2. Map vpage_no to ppage_id
+    uint vpn1 = vpage_no >> 10;
+    uint vpn0 = vpage_no & 0x3FF;
+
+    root = pid_to_pagetable_base[pid];
+    leaf = page_table_leaf(pid, vpn1);
+    page_table_changed(pid);
+    return &leaf[vpn0];
+}
+
+void page_table_map(int pid, uint vpage_no, uint ppage_id) {
     /* Student's code goes here (Virtual Memory). */
 
     /* Remove the soft_tlb_map below and do the following.
@@ -162,57 +550,48 @@ void page_table_map(int pid, uint vpage_no, uint ppage_id) {
      *     update the page tables and map vpage_no to ppage_id based on Sv32. */
     // soft_tlb_map(pid, vpage_no, ppage_id);
 
-    // If page tables to not exist, build them
-    if (!pid_to_pagetable_base[pid]) {
-        if (pid < GPID_USER_START) {
-            pagetable_identity_map(pid);
-            setup_identity_region(pid, RAM_START, 512, USER_RWX);
-            setup_identity_region(pid, APPS_ENTRY, 512, USER_RWX);
-            setup_identity_region(pid, APPS_PAGES_BASE, 512, USER_RWX);
-        } else {
-            /* Allocate the root page table. */
-            uint ppage_id                 = earth->mmu_alloc();
-            root                          = (void*)PAGE_ID_TO_ADDR(ppage_id);
-            page_info_table[ppage_id].pid = pid;
-            pid_to_pagetable_base[pid]    = root;
-            memset(root, 0, PAGE_SIZE);
-
-            setup_identity_region(pid, SHELL_WORK_DIR, 1, USER_RWX);
-        }
-    }
-
-
-    // 2. Map vpage_no to ppage_id
-    uint vpn1 = vpage_no >> 10;
-    uint vpn0 = vpage_no & 0x3FF;
-
-    root = pid_to_pagetable_base[pid];
-
-    if (root[vpn1] & 0x1) {
-        /* Leaf has been allocated. */
-        leaf = (void*)((root[vpn1] << 2) & 0xFFFFF000);
-    } else {
-        /* Allocate the leaf page table. */
-        uint ppage_id                 = earth->mmu_alloc();
-        leaf                          = (void*)PAGE_ID_TO_ADDR(ppage_id);
-        page_info_table[ppage_id].pid = pid;
-        memset(leaf, 0, PAGE_SIZE);
-        root[vpn1] = ((uint)leaf >> 2) | 0x1;
-    }
-
-    leaf[vpn0] = ((uint)(PAGE_ID_TO_ADDR(ppage_id)) >> 2) | USER_RWX;
+    uint* pte = page_table_entry(pid, vpage_no);
+    *pte = ((uint)(PAGE_ID_TO_ADDR(ppage_id)) >> 2) | USER_RWX | PTE_OWNED;
     page_info_table[ppage_id].pid = pid;
     page_info_table[ppage_id].vpage_no = vpage_no;
 
     /* Student's code ends here. */
 }
 
+static uint zero_page_id;
+
+void page_table_map_zero(int pid, uint vpage_no) {
+    /* Share the zero page read-only; the first write copies it. */
+    uint* pte = page_table_entry(pid, vpage_no);
+    *pte = ((uint)PAGE_ID_TO_ADDR(zero_page_id) >> 2) | (USER_RWX & ~PTE_W) |
+           PTE_OWNED | PTE_COW;
+    page_info_table[zero_page_id].use++;
+}
+
+void page_table_map_lazy(int pid, uint vpage_no, uint tag) {
+    /* Leave the page invalid and keep tag in the PTE for the pager; tag 0
+     * is anonymous memory, and pages which are already valid stay as is. */
+    uint* pte = page_table_entry(pid, vpage_no);
+    if (!(*pte & PTE_V)) *pte = (tag << 10) | PTE_LAZY;
+}
+
+static void flush_icache();
+
 void page_table_switch(int pid) {
     /* Student's code goes here (Virtual Memory). */
     if (pid >= MAX_NPROCESS) FATAL("page_table_switch: pid too large");
 
     if (!pid_to_pagetable_base[pid]) FATAL("page_table_switch: page tables not initialised for pid");
 
+    /* Nothing to do if this core runs pid again and the TLB is up to date. */
+    uint core_id, asid = page_table_asid(pid);
+    asm("csrr %0, mhartid" : "=r"(core_id));
+    shootdown_send(core_id);
+    uint stale = pid_stale_cores[pid] & (1 << core_id);
+    if (core_pid[core_id] == pid &&
+        core_generation[core_id] == asid_generation && !stale)
+        return;
+
     /* Remove the soft_tlb_switch below and, instead, update the page table
      * base register (satp) using the value of pid_to_pagetable_base[pid].
      * An example of updating the satp CSR is given in function mmu_init. */
@@ -221,12 +600,293 @@ void page_table_switch(int pid) {
 
     root = pid_to_pagetable_base[pid];
 
-    asm("csrw satp, %0" ::"r"(((uint)root >> 12) | (1 << 31)));
+    asm("csrw satp, %0" ::"r"(((uint)root >> 12) | (asid << 22) | (1 << 31)));
     /* Student's code ends here. */
+
+    if (core_generation[core_id] != asid_generation) {
+        asm("sfence.vma zero,zero");
+        core_generation[core_id] = asid_generation;
+    } else if (stale) {
+        asm("sfence.vma zero,%0" ::"r"(asid));
+    }
+    pid_stale_cores[pid] &= ~(1 << core_id);
+    core_pid[core_id] = pid;
+    flush_icache();
+}
+
+static uint* page_table_walk(int pid, uint vaddr) {
+    /* Return the leaf PTE of vaddr, or NULL if vaddr has no leaf table. */
+    uint* pagetable = pid_to_pagetable_base[pid];
+    if (!pagetable || !(pagetable[vaddr >> 22] & PTE_V) ||
+        PTE_IS_LEAF(pagetable[vaddr >> 22]))
+        return NULL;
+    return PTE_TO_ADDR(pagetable[vaddr >> 22]) + ((vaddr >> 12) & 0x3FF);
+}
+
+static void page_table_flush(int pid, uint vaddr) {
+    /* Flush the page on this core; other cores flush when switching to pid,
+     * or right away if they are running pid. */
+    uint core_id;
+    asm("csrr %0, mhartid" : "=r"(core_id));
+    page_table_changed(pid);
+    shootdown_send(core_id);
+    if (asid_max)
+        asm("sfence.vma %0,%1" ::"r"(vaddr), "r"(pid_to_asid[pid] & 0x1FF));
+    else
+        asm("sfence.vma %0,zero" ::"r"(vaddr));
+}
+
+/* Cold user pages are written to the swap area on the disk when memory runs
+ * out. Victims are chosen by a clock over page_info_table: a page whose
+ * accessed bit is set gets a second chance, and pages shared by several
+ * processes or copy-on-write are skipped. A swapped-out page has PTE_SWAP and
+ * its swap slot in the PTE, and is read back on the next access. */
+#define SWAP_NSLOTS      (SWAP_DISK_SIZE / PAGE_SIZE)
+#define SWAP_SLOT_NBLOCK (PAGE_SIZE / BLOCK_SIZE)
+static uint swap_map[SWAP_NSLOTS / 32]; /* bit set means slot in use */
+static uint swap_clock_hand, swap_out_count, swap_in_count;
+
+static void swap_slot_free(uint slot) {
+    swap_map[slot / 32] &= ~(1 << (slot % 32));
+}
+
+/* Swap runs in the kernel only (see MMU_CALL), holding kernel_lock, so no
+ * transfer of the kernel's disk request queue starts meanwhile, and
+ * disk_read/disk_write wait for the one in flight. */
+static void swap_io(uint slot, uint ppage_id, int write) {
+    uint block_no = SWAP_DISK_START + slot * SWAP_SLOT_NBLOCK;
+    char* buf     = PAGE_ID_TO_ADDR(ppage_id);
+    if (write)
+        earth->disk_write(block_no, SWAP_SLOT_NBLOCK, buf);
+    else
+        earth->disk_read(block_no, SWAP_SLOT_NBLOCK, buf);
+}
+
+static int swap_out() {
+    if (earth->translation != PAGE_TABLE) return 0;
+
+    uint slot = 0;
+    while (slot < SWAP_NSLOTS && swap_map[slot / 32] == 0xFFFFFFFF) slot += 32;
+    if (slot == SWAP_NSLOTS) return 0;
+    slot += __builtin_ctz(~swap_map[slot / 32]);
+
+    /* Another core running the owner could keep using the page through its
+     * TLB, and it cannot take the shootdown while this core holds kernel_lock,
+     * so only pages of processes not running elsewhere are victims. */
+    uint core_id, busy;
+    asm("csrr %0, mhartid" : "=r"(core_id));
+
+    /* Two rounds of the clock, since the first may only clear accessed bits. */
+    for (uint n = 0; n < 2 * APPS_PAGES_CNT; n++) {
+        uint ppage_id   = swap_clock_hand;
+        swap_clock_hand = (swap_clock_hand + 1) % APPS_PAGES_CNT;
+
+        struct page_info* page = &page_info_table[ppage_id];
+        if (page->use != 1 || page->pid < GPID_USER_START ||
+            page->pid >= MAX_NPROCESS || !page->vpage_no)
+            continue;
+        busy = 0;
+        for (uint i = 0; i < NCORES; i++)
+            if (i != core_id && core_pid[i] == page->pid) busy = 1;
+        if (busy) continue;
+        uint* pte = page_table_walk(page->pid, page->vpage_no << 12);
+        uint flags = PTE_V | PTE_OWNED | PTE_COW;
+        if (!pte || (*pte & flags) != (PTE_V | PTE_OWNED) ||
+            ADDR_TO_PAGE_ID(PTE_TO_ADDR(*pte)) != ppage_id)
+            continue;
+        if (*pte & PTE_A) {
+            *pte &= ~PTE_A;
+            page_table_changed(page->pid);
+            continue;
+        }
+
+        /* Unmap the page and flush it on this core before writing it out;
+         * other cores flush when they switch to the owner. */
+        swap_map[slot / 32] |= 1 << (slot % 32);
+        *pte = (slot << 10) | PTE_SWAP;
+        page_table_flush(page->pid, page->vpage_no << 12);
+        swap_io(slot, ppage_id, 1);
+        mmu_free_pages(ppage_id, 0);
+        swap_out_count++;
+        return 1;
+    }
+    return 0;
+}
+
+static void swap_stats() {
+    if (swap_out_count)
+        INFO("%d pages swapped out and %d swapped in", swap_out_count,
+             swap_in_count);
+}
+
+static void swap_in(int pid, uint vaddr, uint* pte) {
+    /* The leaf table holding pte is never swapped out. */
+    uint slot = *pte >> 10;
+    uint ppage_id = earth->mmu_alloc();
+    swap_io(slot, ppage_id, 0);
+    swap_slot_free(slot);
+    page_table_map(pid, vaddr >> 12, ppage_id);
+    swap_in_count++;
+}
+
+#define PTE_IS_SWAPPED(x) (!((x) & PTE_V) && ((x) & PTE_SWAP))
+
+int page_table_fault(int pid, uint vaddr, uint mcause) {
+#define EXCP_ID_STORE_PAGE_FAULT 15
+    if (pid >= MAX_NPROCESS) return -1;
+    uint* pte = page_table_walk(pid, vaddr);
+    if (!pte) return -1;
+
+    /* Read a swapped-out page back; swapping out other pages on the way
+     * may leave stale entries of pid in the TLB, so flush all of them. */
+    if (PTE_IS_SWAPPED(*pte)) {
+        swap_in(pid, vaddr, pte);
+        page_table_changed(pid);
+        asm("sfence.vma zero,zero");
+        return 0;
+    }
+
+    /* The CPU may fault instead of setting the accessed bit cleared by
+     * swap_out(). */
+    if ((*pte & PTE_V) && !(*pte & PTE_A)) {
+        *pte |= PTE_A;
+        page_table_flush(pid, vaddr);
+        return 0;
+    }
+
+    /* Hand the tag of a page from page_table_map_lazy to the pager. */
+    if (!(*pte & PTE_V) && !(*pte & PTE_LAZY)) return -1;
+    if (!(*pte & PTE_V) && (*pte >> 10)) return *pte >> 10;
+
+    /* Anonymous memory reads the zero page until the first write. */
+    if (!(*pte & PTE_V)) {
+        if (mcause == EXCP_ID_STORE_PAGE_FAULT) {
+            page_table_map(pid, vaddr >> 12, mmu_alloc_zeroed());
+        } else {
+            page_table_map_zero(pid, vaddr >> 12);
+        }
+        page_table_flush(pid, vaddr);
+        return 0;
+    }
+    if (mcause != EXCP_ID_STORE_PAGE_FAULT || !(*pte & PTE_COW)) return -1;
+
+    /* Copy the page on the first write unless this is the last reference. */
+    uint old_id = ADDR_TO_PAGE_ID(PTE_TO_ADDR(*pte));
+    if (page_info_table[old_id].use > 1) {
+        uint new_id = earth->mmu_alloc();
+        page_copy(PAGE_ID_TO_ADDR(new_id), PAGE_ID_TO_ADDR(old_id));
+        page_info_table[new_id].pid      = pid;
+        page_info_table[new_id].vpage_no = vaddr >> 12;
+        page_put(old_id);
+        *pte = ((uint)PAGE_ID_TO_ADDR(new_id) >> 2) | USER_RWX | PTE_OWNED;
+    } else {
+        *pte = (*pte | PTE_W) & ~PTE_COW;
+    }
+    page_table_flush(pid, vaddr);
+    return 0;
+}
+
+int page_table_fork(int src_pid, int dst_pid) {
+    if (dst_pid >= MAX_NPROCESS) FATAL("page_table_fork: pid too large");
+    uint* src_root = pid_to_pagetable_base[src_pid];
+
+    root                           = page_table_alloc(dst_pid);
+    pid_to_pagetable_base[dst_pid] = root;
+
+    for (uint vpn1 = 0; vpn1 < 1024; vpn1++) {
+        if (!(src_root[vpn1] & PTE_V)) continue;
+        if (PTE_IS_LEAF(src_root[vpn1]) ||
+            PTE_IS_SHARED(src_root[vpn1], src_pid)) {
+            root[vpn1] = src_root[vpn1];
+            continue;
+        }
+        uint* src_leaf = PTE_TO_ADDR(src_root[vpn1]);
+
+        /* Every leaf table is copied, but the user pages are shared. */
+        leaf       = page_table_alloc(dst_pid);
+        root[vpn1] = ((uint)leaf >> 2) | PTE_V;
+
+        for (uint vpn0 = 0; vpn0 < 1024; vpn0++) {
+            /* A swap slot has one owner, so the page is read back first. */
+            if (PTE_IS_SWAPPED(src_leaf[vpn0]))
+                swap_in(src_pid, (vpn1 << 22) | (vpn0 << 12), &src_leaf[vpn0]);
+            if (!(src_leaf[vpn0] & PTE_OWNED)) continue;
+            if (src_leaf[vpn0] & PTE_W)
+                src_leaf[vpn0] = (src_leaf[vpn0] & ~PTE_W) | PTE_COW;
+            page_info_table[ADDR_TO_PAGE_ID(PTE_TO_ADDR(src_leaf[vpn0]))].use++;
+        }
+        page_copy(leaf, src_leaf);
+    }
+
+    /* The source process loses write access to its pages as well. */
+    page_table_changed(src_pid);
+    page_table_changed(dst_pid);
+    earth->mmu_flush_cache();
+    return 0;
+}
+
+static int page_table_release_later(int pid) {
+    /* Before the frames of pid are reused, the cores which may still run pid
+     * flush their TLBs. This core flushes right away; other cores hold no
+     * kernel_lock, so return 1 and let mmu_shootdown() release the frames
+     * after the last of them has flushed. Cores which ran pid earlier keep
+     * entries under the old ASID, which is not handed out again before a new
+     * generation flushes every core. */
+    uint core_id, cores = 0;
+    asm("csrr %0, mhartid" : "=r"(core_id));
+    if (core_pid[core_id] == pid) {
+        asm("sfence.vma zero,zero");
+        core_pid[core_id] = -1;
+    }
+    for (uint i = 0; i < NCORES; i++)
+        if (i != core_id && core_pid[i] == pid) {
+            cores |= 1 << i;
+            shootdown_requests++;
+        }
+    if (!cores || !pid_to_pagetable_base[pid]) return 0;
+
+    pid_release_cores[pid] = cores;
+    __sync_fetch_and_or(&shootdown_flush_all, cores);
+    __sync_fetch_and_or(&shootdown_cores, cores);
+    shootdown_send(core_id);
+    return 1;
+}
+
+static int page_table_release(int pid, int* saved_count) {
+    uint* pagetable = pid_to_pagetable_base[pid];
+    if (!pagetable) return 0;
+
+    int page_count = 0;
+    for (uint vpn1 = 0; vpn1 < 1024; vpn1++) {
+        if (!(pagetable[vpn1] & PTE_V)) continue;
+        if (PTE_IS_LEAF(pagetable[vpn1]) ||
+            PTE_IS_SHARED(pagetable[vpn1], pid)) {
+            (*saved_count)++;
+            continue;
+        }
+        uint* pte = PTE_TO_ADDR(pagetable[vpn1]);
+        for (uint vpn0 = 0; vpn0 < 1024; vpn0++)
+            if (pte[vpn0] & PTE_OWNED)
+                page_count += page_put(ADDR_TO_PAGE_ID(PTE_TO_ADDR(pte[vpn0])));
+            else if (PTE_IS_SWAPPED(pte[vpn0]))
+                swap_slot_free(pte[vpn0] >> 10);
+    }
+    pid_to_pagetable_base[pid] = NULL;
+
+    /* A new process with the same pid gets a new ASID. */
+    pid_to_asid[pid] = 0;
+    return page_count;
 }
 
 uint page_table_translate(int pid, uint vaddr) {
     if (pid >= MAX_NPROCESS) FATAL("page_table_translate: pid too large");
+    /* The kernel may write to the returned address, e.g., in proc_try_recv,
+     * so a copy-on-write page is made private to pid before translation. */
+    uint* pte = page_table_walk(pid, vaddr);
+    if (pte && PTE_IS_SWAPPED(*pte)) swap_in(pid, vaddr, pte);
+    if (pte && (*pte & PTE_COW))
+        page_table_fault(pid, vaddr, EXCP_ID_STORE_PAGE_FAULT);
+
     /* Student's code goes here (Virtual Memory). */
 
     /* Remove the following line of code. Walk through the page tables
@@ -242,7 +902,11 @@ uint page_table_translate(int pid, uint vaddr) {
     if (!(root[vpn1] & 0x1)) {
         FATAL("Root PTE not valid for vpn1: %x", vpn1);
     }
-    
+
+    /* A megapage maps 4MB, so the lower 22 bits are the offset. */
+    if (PTE_IS_LEAF(root[vpn1]))
+        return ((root[vpn1] << 2) & 0xFFC00000) | (vaddr & 0x3FFFFF);
+
     leaf = (void*)((root[vpn1] << 2) & 0xFFFFF000);
     uint paddr = (((leaf[vpn0] << 2) & 0xFFFFF000) | offset);
 
@@ -255,7 +919,7 @@ uint page_table_translate(int pid, uint vaddr) {
     /* Student's code ends here. */
 }
 
-void flush_cache() {
+static void flush_icache() {
     if (earth->platform == HARDWARE) {
         /* Flush the L1 instruction cache. */
         /* See
@@ -263,6 +927,10 @@ void flush_cache() {
          */
         asm(".word(0x100F)\nnop\nnop\nnop\nnop\nnop\n");
     }
+}
+
+void flush_cache() {
+    flush_icache();
     if (earth->translation == PAGE_TABLE) {
         /* Flush the TLB, the cache for page table entries. */
         /* See
@@ -272,10 +940,96 @@ void flush_cache() {
     }
 }
 
+/* The kernel allocates and maps pages holding kernel_lock, e.g., to copy a
+ * copy-on-write page, while system processes like sys_proc allocate and map
+ * pages for spawn, the pager and exit. So the earth interface below runs the
+ * call right away in the kernel, and a process asks the kernel to run it with
+ * a SYS_MMU system call; mmu_syscall() runs it in both cases. */
+enum {
+    MMU_ALLOC_PAGES,
+    MMU_FREE_PAGES,
+    MMU_ALLOC_ZEROED,
+    MMU_FREE,
+    MMU_MAP,
+    MMU_MAP_ZERO,
+    MMU_MAP_LAZY,
+    MMU_TRANSLATE
+};
+static void (*mmu_map_impl)(int pid, uint vpage_no, uint ppage_id);
+static void (*mmu_map_zero_impl)(int pid, uint vpage_no);
+static void (*mmu_map_lazy_impl)(int pid, uint vpage_no, uint tag);
+static uint (*mmu_translate_impl)(int pid, uint vaddr);
+
+uint mmu_syscall(uint op, uint arg0, uint arg1, uint arg2) {
+    switch (op) {
+    case MMU_ALLOC_PAGES:
+        return mmu_alloc_pages(arg0);
+    case MMU_FREE_PAGES:
+        mmu_free_pages(arg0, arg1);
+        return 0;
+    case MMU_ALLOC_ZEROED:
+        return mmu_alloc_zeroed();
+    case MMU_FREE:
+        mmu_free(arg0);
+        return 0;
+    case MMU_MAP:
+        mmu_map_impl(arg0, arg1, arg2);
+        return 0;
+    case MMU_MAP_ZERO:
+        mmu_map_zero_impl(arg0, arg1);
+        return 0;
+    case MMU_MAP_LAZY:
+        mmu_map_lazy_impl(arg0, arg1, arg2);
+        return 0;
+    case MMU_TRANSLATE:
+        return mmu_translate_impl(arg0, arg1);
+    default:
+        FATAL("mmu_syscall: invalid call %d", op);
+    }
+}
+
+#define MMU_CALL(op, arg0, arg1, arg2)                                         \
+    (mmu_in_kernel() ? mmu_syscall(op, arg0, arg1, arg2)                       \
+                     : grass->sys_mmu(op, arg0, arg1, arg2))
+
+static uint mmu_alloc_call() { return MMU_CALL(MMU_ALLOC_PAGES, 0, 0, 0); }
+static uint mmu_alloc_pages_call(uint order) {
+    return MMU_CALL(MMU_ALLOC_PAGES, order, 0, 0);
+}
+static void mmu_free_pages_call(uint ppage_id, uint order) {
+    MMU_CALL(MMU_FREE_PAGES, ppage_id, order, 0);
+}
+static uint mmu_alloc_zeroed_call() {
+    return MMU_CALL(MMU_ALLOC_ZEROED, 0, 0, 0);
+}
+static void mmu_free_call(int pid) { MMU_CALL(MMU_FREE, pid, 0, 0); }
+static void mmu_map_call(int pid, uint vpage_no, uint ppage_id) {
+    MMU_CALL(MMU_MAP, pid, vpage_no, ppage_id);
+}
+static void mmu_map_zero_call(int pid, uint vpage_no) {
+    MMU_CALL(MMU_MAP_ZERO, pid, vpage_no, 0);
+}
+static void mmu_map_lazy_call(int pid, uint vpage_no, uint tag) {
+    MMU_CALL(MMU_MAP_LAZY, pid, vpage_no, tag);
+}
+static uint mmu_translate_call(int pid, uint vaddr) {
+    return MMU_CALL(MMU_TRANSLATE, pid, vaddr, 0);
+}
+
 void mmu_init() {
-    earth->mmu_free        = mmu_free;
-    earth->mmu_alloc       = mmu_alloc;
-    earth->mmu_flush_cache = flush_cache;
+    earth->mmu_free         = mmu_free_call;
+    earth->mmu_alloc        = mmu_alloc_call;
+    earth->mmu_free_pages   = mmu_free_pages_call;
+    earth->mmu_alloc_pages  = mmu_alloc_pages_call;
+    earth->mmu_alloc_zeroed = mmu_alloc_zeroed_call;
+    earth->mmu_zero_idle    = mmu_zero_idle;
+    earth->mmu_flush_cache  = flush_cache;
+    earth->mmu_shootdown    = mmu_shootdown;
+    earth->mmu_syscall      = mmu_syscall;
+
+    /* Fill zero_pool, so the first allocations can be served from it. */
+    for (uint i = 0; i < ZERO_POOL_SIZE; i++) page_release(mmu_alloc());
+    mmu_zero_idle();
 
     /* Setup a PMP region for the whole 4GB address space. */
     asm("csrw pmpaddr0, %0" : : "r"(0x40000000));
@@ -301,16 +1055,39 @@ void mmu_init() {
     if (earth->translation == PAGE_TABLE) {
         /* Setup an identity map using page tables. */
         pagetable_identity_map(0);
+
+        /* The ASID bits which are not implemented are read back as zero. */
+        uint satp = ((uint)root >> 12) | (0x1FF << 22) | (1 << 31);
+        asm("csrw satp, %0" ::"r"(satp));
+        asm("csrr %0, satp" : "=r"(satp));
+        asid_max = (satp >> 22) & 0x1FF;
         asm("csrw satp, %0" ::"r"(((uint)root >> 12) | (1 << 31)));
+        INFO("The CPU supports %d ASIDs", asid_max + 1);
+
+        /* The zero page is never freed since mmu_free(0) is never called. */
+        zero_page_id = mmu_alloc();
+        page_zero(PAGE_ID_TO_ADDR(zero_page_id));
 
-        earth->mmu_map       = page_table_map;
-        earth->mmu_switch    = page_table_switch;
-        earth->mmu_translate = page_table_translate;
+        mmu_map_impl       = page_table_map;
+        earth->mmu_switch  = page_table_switch;
+        mmu_translate_impl = page_table_translate;
+        earth->mmu_fork    = page_table_fork;
+        earth->mmu_fault   = page_table_fault;
+        mmu_map_zero_impl  = page_table_map_zero;
+        mmu_map_lazy_impl  = page_table_map_lazy;
     } else {
-        earth->mmu_map       = soft_tlb_map;
-        earth->mmu_switch    = soft_tlb_switch;
-        earth->mmu_translate = soft_tlb_translate;
+        mmu_map_impl       = soft_tlb_map;
+        earth->mmu_switch  = soft_tlb_switch;
+        mmu_translate_impl = soft_tlb_translate;
+        earth->mmu_fork    = soft_tlb_fork;
+        earth->mmu_fault   = soft_tlb_fault;
+        mmu_map_zero_impl  = soft_tlb_map_zero;
+        mmu_map_lazy_impl  = soft_tlb_map_lazy;
     }
+    earth->mmu_map       = mmu_map_call;
+    earth->mmu_map_zero  = mmu_map_zero_call;
+    earth->mmu_map_lazy  = mmu_map_lazy_call;
+    earth->mmu_translate = mmu_translate_call;
 }
 
 void post_boot_mmu_init() {
@@ -319,7 +1096,7 @@ void post_boot_mmu_init() {
     asm("csrw pmpcfg0, %0" : : "r"(0xF));
 
 
-    /* Setup an identity map using page tables. */
-    // pagetable_identity_map(0);
+    /* Use the identity map built by mmu_init on the first core. */
+    root = pid_to_pagetable_base[0];
     asm("csrw satp, %0" ::"r"(((uint)root >> 12) | (1 << 31)));
 }
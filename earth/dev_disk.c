@@ -18,13 +18,34 @@
 #define SDHCI_CMD_AND_MODE     0x0C
 #define SDHCI_RESPONSE0        0x10
 #define SDHCI_PRESENT_STATE    0x24
+#define SDHCI_HOST_CONTROL     0x28
 #define SDHCI_CLKCON           0x2C
 #define SDHCI_SOFTWARE_RESET   0x2F
 #define SDHCI_INT_STAT         0x30
 #define SDHCI_INT_STAT_ENABLE  0x34
 #define SDHCI_INT_SIG_ENABLE   0x38
-
-static char sdhci_exec_cmd(uint idx, uint arg, uchar flag, uint mode) {
+#define SDHCI_ADMA_ADDRESS     0x58
+
+/* Transfers use ADMA2 (Chapter 1.13 of the document above): a table of
+ * descriptors, each moving up to one page between the card and memory, so
+ * that one command moves any number of blocks straight to or from the
+ * caller's buffer. Buffers which are not word-aligned go through the bounce
+ * buffer, a block of 2^SDHCI_DMA_ORDER pages from the buddy allocator. */
+#define SDHCI_DMA_ORDER      1
+#define SDHCI_DMA_NBLOCKS    ((4096 << SDHCI_DMA_ORDER) / BLOCK_SIZE)
+#define SDHCI_ADMA_NDESC     64
+#define SDHCI_ADMA_MAXBLOCKS 256 /* per command, at most 33 descriptors */
+#define ADMA_VALID_TRAN_END  0x23 /* attributes: valid, end, act=tran */
+#define ADMA_VALID_TRAN      0x21
+static char* sdhci_dma_buf;
+static struct {
+    ushort attr, len;
+    uint addr;
+} sdhci_adma_desc[SDHCI_ADMA_NDESC] __attribute__((aligned(8)));
+uint mmu_alloc_pages(uint order);
+ulonglong mtime_get();
+
+static void sdhci_issue_cmd(uint idx, uint arg, uchar flag, uint mode) {
     /* Wait until the SD controller to be ready for a new command. */
     while (REGW(SDHCI_BASE, SDHCI_PRESENT_STATE) & 0x3);
 
@@ -34,61 +55,169 @@ static char sdhci_exec_cmd(uint idx, uint arg, uchar flag, uint mode) {
     /* Issue the command. */
     REGW(SDHCI_BASE, SDHCI_ARGUMENT)     = arg;
     REGW(SDHCI_BASE, SDHCI_CMD_AND_MODE) = (((idx << 8) | flag) << 16) | mode;
+}
+
+static char sdhci_exec_cmd(uint idx, uint arg, uchar flag, uint mode) {
+    sdhci_issue_cmd(idx, arg, flag, mode);
 
     /* Wait for the command to be completed. */
     while (!(REGW(SDHCI_BASE, SDHCI_INT_STAT) & 0x1));
 }
 
-static void sdhci_read(uint offset, char* dst) {
-    /* Prepare DMA (SDMA mode of SDHCI). */
-    static __attribute__((aligned(BLOCK_SIZE))) char aligned_buf[BLOCK_SIZE];
-    REGW(SDHCI_BASE, SDHCI_DMA_ADDRESS)      = (uint)aligned_buf;
-    REGW(SDHCI_BASE, SDHCI_BLK_CNT_AND_SIZE) = (1 << 16) | BLOCK_SIZE;
+static uint sdhci_dma_addr(int pid, char* buf) {
+    /* Only the apps region is mapped to private pages with page tables; a
+     * system process finds its pid at APPS_PID to translate it, and the
+     * kernel passes the pid of the process it transfers for. */
+    if (earth->translation == PAGE_TABLE && (uint)buf >= APPS_ENTRY &&
+        (uint)buf < APPS_PAGES_BASE)
+        return earth->mmu_translate(pid < 0 ? *(int*)APPS_PID : pid,
+                                    (uint)buf);
+    return (uint)buf;
+}
 
-#define DATA_PRESENT_FLAG         (1 << 5)
-#define READ_WITH_DMA_ENABLE_MODE ((1 << 4) | (1 << 0))
-    /* Send and wait for a read request with command #17. */
-    offset *= BLOCK_SIZE;
-    sdhci_exec_cmd(17, offset, DATA_PRESENT_FLAG, READ_WITH_DMA_ENABLE_MODE);
+#define DATA_PRESENT_FLAG          (1 << 5)
+#define READ_WITH_DMA_ENABLE_MODE  ((1 << 4) | (1 << 0))
+#define WRITE_WITH_DMA_ENABLE_MODE ((0 << 4) | (1 << 0))
+#define AUTO_CMD12_MODE            (1 << 2)
+#define INT_TRANSFER_DONE          (1 << 1)
+#define INT_ERROR                  (1 << 15)
+#define INT_ERROR_SIGNALS          (0x27F << 16)
+
+static void sdhci_adma_setup(int pid, uint nblocks, char* buf) {
+    /* Describe buf page by page, since its pages may not be contiguous. */
+    uint ndesc = 0;
+    for (uint off = 0; off < nblocks * BLOCK_SIZE; ndesc++) {
+        uint len = 4096 - ((uint)(buf + off) & 0xFFF);
+        if (len > nblocks * BLOCK_SIZE - off) len = nblocks * BLOCK_SIZE - off;
+        sdhci_adma_desc[ndesc].attr = ADMA_VALID_TRAN;
+        sdhci_adma_desc[ndesc].len  = len;
+        sdhci_adma_desc[ndesc].addr = sdhci_dma_addr(pid, buf + off);
+        off += len;
+    }
+    sdhci_adma_desc[ndesc - 1].attr = ADMA_VALID_TRAN_END;
 
-    memcpy(dst, aligned_buf, BLOCK_SIZE);
+    REGW(SDHCI_BASE, SDHCI_ADMA_ADDRESS)     = (uint)sdhci_adma_desc;
+    REGW(SDHCI_BASE, SDHCI_BLK_CNT_AND_SIZE) = (nblocks << 16) | BLOCK_SIZE;
 }
 
-static void sdhci_multiple_write(uint offset, uint nblocks, char* src) {
-    if(nblocks > 8) FATAL("sdhci_multiple_write: Can only write 8 blocks at a time");
-    /* Prepare DMA (SDMA mode of SDHCI). */
+static void sdhci_transfer(uint cmd, uint offset, uint nblocks, char* buf) {
+    sdhci_adma_setup(-1, nblocks, buf);
+
+    uint mode = (cmd == 24 || cmd == 25) ? WRITE_WITH_DMA_ENABLE_MODE
+                                         : READ_WITH_DMA_ENABLE_MODE;
+    sdhci_exec_cmd(cmd, offset * BLOCK_SIZE, DATA_PRESENT_FLAG, mode);
+    while (!(REGW(SDHCI_BASE, SDHCI_INT_STAT) & (INT_TRANSFER_DONE | INT_ERROR)));
+    if (REGW(SDHCI_BASE, SDHCI_INT_STAT) & INT_ERROR)
+        FATAL("sdhci_transfer: error 0x%x for block %d",
+              REGW(SDHCI_BASE, SDHCI_INT_STAT), offset);
+    if (cmd == 18 || cmd == 25) sdhci_exec_cmd(12, 0x0, 0x0, 0x0);
+}
 
-    static __attribute__((aligned(BLOCK_SIZE))) char aligned_buf[8 * BLOCK_SIZE];
-    memcpy(aligned_buf, src, BLOCK_SIZE * nblocks);
+/* A transfer started by disk_start() for the kernel's disk request queue;
+ * it raises an interrupt through the PLIC when it completes, and the card
+ * sends command #12 by itself at the end (auto CMD12). */
+static int sdhci_busy, sdhci_done;
+static struct {
+    int pid;
+    char* buf;
+    uint bounce_len; /* bytes to copy out of the bounce buffer, if any */
+} sdhci_async;
+
+static void sdhci_bounce(int pid, char* buf, uint len, int to_buf) {
+    /* Copy between the bounce buffer and buf of process pid page by page. */
+    for (uint off = 0, n; off < len; off += n) {
+        n = 4096 - ((uint)(buf + off) & 0xFFF);
+        if (n > len - off) n = len - off;
+        char* addr = (char*)sdhci_dma_addr(pid, buf + off);
+        to_buf ? memcpy(addr, sdhci_dma_buf + off, n)
+               : memcpy(sdhci_dma_buf + off, addr, n);
+    }
+}
 
-    REGW(SDHCI_BASE, SDHCI_DMA_ADDRESS)      = (uint)aligned_buf;
-    REGW(SDHCI_BASE, SDHCI_BLK_CNT_AND_SIZE) = (nblocks << 16) | BLOCK_SIZE;
-    
-#define DATA_PRESENT_FLAG         (1 << 5)
-#define WRITE_WITH_DMA_ENABLE_MODE ((0 << 4) | (1 << 0))
-    offset *= BLOCK_SIZE;
-    sdhci_exec_cmd(25, offset, DATA_PRESENT_FLAG, WRITE_WITH_DMA_ENABLE_MODE);
-    sdhci_exec_cmd(12, 0x0, 0x0, 0x0);
+static void sdhci_poll() {
+    if (!sdhci_busy) return;
+    uint stat = REGW(SDHCI_BASE, SDHCI_INT_STAT);
+    if (!(stat & (INT_TRANSFER_DONE | INT_ERROR))) return;
+    if (stat & INT_ERROR) FATAL("sdhci_poll: error 0x%x", stat);
+
+    /* Clear the status, which also lowers the interrupt signal. */
+    REGW(SDHCI_BASE, SDHCI_INT_SIG_ENABLE) = 0x0;
+    REGW(SDHCI_BASE, SDHCI_INT_STAT)       = 0xFFFFFFFF;
+    if (sdhci_async.bounce_len)
+        sdhci_bounce(sdhci_async.pid, sdhci_async.buf, sdhci_async.bounce_len,
+                     1);
+    sdhci_busy = 0;
+    sdhci_done = 1;
 }
 
-static void sdhci_multiple_read(uint offset, uint nblocks, char* dst) {
-    if(nblocks > 8) FATAL("sdhci_multiple_read: Can only read 8 blocks at a time");
-    /* Prepare DMA (SDMA mode of SDHCI). */
+static void sdhci_wait() {
+    /* Let a transfer in the background finish before using the card. */
+    while (sdhci_busy) sdhci_poll();
+}
 
-    static __attribute__((aligned(BLOCK_SIZE))) char aligned_buf[8 * BLOCK_SIZE];
-    REGW(SDHCI_BASE, SDHCI_DMA_ADDRESS)      = (uint)aligned_buf;
-    REGW(SDHCI_BASE, SDHCI_BLK_CNT_AND_SIZE) = (nblocks << 16) | BLOCK_SIZE;
+static uint sdhci_start(int pid, uint offset, uint nblocks, char* buf,
+                        int write) {
+    uint unaligned = (uint)buf & 3;
+    uint max = unaligned ? SDHCI_DMA_NBLOCKS : SDHCI_ADMA_MAXBLOCKS;
+    if (nblocks > max) nblocks = max;
+
+    sdhci_async.pid        = pid;
+    sdhci_async.buf        = buf;
+    sdhci_async.bounce_len = (unaligned && !write) ? nblocks * BLOCK_SIZE : 0;
+    if (unaligned && write) sdhci_bounce(pid, buf, nblocks * BLOCK_SIZE, 0);
+    sdhci_adma_setup(pid, nblocks, unaligned ? sdhci_dma_buf : buf);
+
+    uint mode = write ? WRITE_WITH_DMA_ENABLE_MODE : READ_WITH_DMA_ENABLE_MODE;
+    sdhci_issue_cmd(write ? 25 : 18, offset * BLOCK_SIZE, DATA_PRESENT_FLAG,
+                    mode | AUTO_CMD12_MODE);
+    REGW(SDHCI_BASE, SDHCI_INT_SIG_ENABLE) = INT_TRANSFER_DONE |
+                                             INT_ERROR_SIGNALS;
+    sdhci_busy = 1;
+    return nblocks;
+}
 
-#define DATA_PRESENT_FLAG         (1 << 5)
-#define READ_WITH_DMA_ENABLE_MODE ((1 << 4) | (1 << 0))
+static void sdhci_read(uint offset, char* dst) {
+    /* Send and wait for a read request with command #17. */
+    if ((uint)dst & 3) {
+        sdhci_transfer(17, offset, 1, sdhci_dma_buf);
+        memcpy(dst, sdhci_dma_buf, BLOCK_SIZE);
+    } else {
+        sdhci_transfer(17, offset, 1, dst);
+    }
+}
 
-    offset *= BLOCK_SIZE;
-    sdhci_exec_cmd(18, offset, DATA_PRESENT_FLAG, READ_WITH_DMA_ENABLE_MODE);
-    sdhci_exec_cmd(12, 0x0, 0x0, 0x0);
-    memcpy(dst, aligned_buf, BLOCK_SIZE * nblocks);
+static void sdhci_multiple_write(uint offset, uint nblocks, char* src) {
+    /* Write with command #25, then stop the transmission with command #12. */
+    uint max = ((uint)src & 3) ? SDHCI_DMA_NBLOCKS : SDHCI_ADMA_MAXBLOCKS;
+    for (uint n; nblocks; offset += n, src += n * BLOCK_SIZE, nblocks -= n) {
+        n = nblocks < max ? nblocks : max;
+        if ((uint)src & 3) {
+            memcpy(sdhci_dma_buf, src, BLOCK_SIZE * n);
+            sdhci_transfer(25, offset, n, sdhci_dma_buf);
+        } else {
+            sdhci_transfer(25, offset, n, src);
+        }
+    }
+}
+
+static void sdhci_multiple_read(uint offset, uint nblocks, char* dst) {
+    /* Read with command #18, then stop the transmission with command #12. */
+    uint max = ((uint)dst & 3) ? SDHCI_DMA_NBLOCKS : SDHCI_ADMA_MAXBLOCKS;
+    for (uint n; nblocks; offset += n, dst += n * BLOCK_SIZE, nblocks -= n) {
+        n = nblocks < max ? nblocks : max;
+        if ((uint)dst & 3) {
+            sdhci_transfer(18, offset, n, sdhci_dma_buf);
+            memcpy(dst, sdhci_dma_buf, BLOCK_SIZE * n);
+        } else {
+            sdhci_transfer(18, offset, n, dst);
+        }
+    }
 }
 
 static int sdhci_init() {
+    sdhci_dma_buf = (char*)APPS_PAGES_BASE +
+                    mmu_alloc_pages(SDHCI_DMA_ORDER) * 4096;
+
 #define PCI_ECAM_ALLOW_MMIO_AND_DMA ((1 << 1) | (1 << 2))
     /* Set the PCI ECAM base address register as SDHCI_BASE. */
     REGW(SDHCI_PCI_ECAM, 0x4)  = PCI_ECAM_ALLOW_MMIO_AND_DMA;
@@ -99,6 +228,9 @@ static int sdhci_init() {
     while (REGB(SDHCI_BASE, SDHCI_SOFTWARE_RESET) & 0x1);
     REGB(SDHCI_BASE, SDHCI_CLKCON) = 0x5;
 
+    /* Select 32-bit ADMA2 for DMA transfers. */
+    REGB(SDHCI_BASE, SDHCI_HOST_CONTROL) = (2 << 3);
+
     /* Enable interrupt status, but disable interrupt signal. */
     REGW(SDHCI_BASE, SDHCI_INT_SIG_ENABLE)  = 0x0;
     REGW(SDHCI_BASE, SDHCI_INT_STAT_ENABLE) = 0x27F003B;
@@ -162,52 +294,66 @@ static void sdspi_read(uint offset, char* dst) {
     spi_exchange(0xFF);
 }
 
+static void sdspi_stop_read() {
+    /* Stop a multiple block read with command #12, skip the stuff byte sent
+     * right after the command and wait for the reply and the busy signal. */
+    char reply, cmd12[] = {12 | (1 << 6), 0x00, 0x00, 0x00, 0x00, 0xFF};
+    for (uint i = 0; i < 6; i++) spi_exchange(cmd12[i]);
+    spi_exchange(0xFF);
+    while ((reply = spi_exchange(0xFF)) == 0xFF);
+    if (reply) FATAL("cmd12 returns status 0x%.2x", reply);
+    while (spi_exchange(0xFF) != 0xFF);
+}
+
 static void sdspi_multiple_read(uint offset, uint nblocks, char* dst) {
-    INFO("sdspi_multiple_read(%d, %d, %x)", offset, nblocks, dst);
     /* Wait until SD card is ready for a new command. */
     while (spi_exchange(0xFF) != 0xFF);
 
-    /* Set block count prior to read with command #23*/
-    char* arg = (void*)&nblocks;
-    char reply, cmd23[] = {23 | (1 << 6), arg[1], arg[0], 0xFF, 0xFF, 0xFF};
-    if (reply = sdspi_exec_cmd(cmd23))
-        FATAL("cmd23 returns status 0x%.2x", reply);
-
     /* Send a read request with command #18. */
-    arg = (void*)&offset;
-    char cmd18[] = {18 | (1 << 6), arg[3], arg[2], arg[1], arg[0], 0xFF};
+    char* arg = (void*)&offset;
+    char reply, cmd18[] = {18 | (1 << 6), arg[3], arg[2], arg[1], arg[0], 0xFF};
     if (reply = sdspi_exec_cmd(cmd18))
         FATAL("cmd18 returns status 0x%.2x", reply);
 
-    /* Wait for the data packet and ignore the 2-byte checksum. */
-    while (spi_exchange(0xFF) != 0xFE);
-    for (uint i = 0; i < BLOCK_SIZE; i++) dst[i] = spi_exchange(0xFF);
-    spi_exchange(0xFF);
-    spi_exchange(0xFF);
+    /* Every block comes in its own data packet; ignore the 2-byte checksum. */
+    for (uint n = 0; n < nblocks; n++, dst += BLOCK_SIZE) {
+        while (spi_exchange(0xFF) != 0xFE);
+        for (uint i = 0; i < BLOCK_SIZE; i++) dst[i] = spi_exchange(0xFF);
+        spi_exchange(0xFF);
+        spi_exchange(0xFF);
+    }
+    sdspi_stop_read();
 }
 
 static void sdspi_multiple_write(uint offset, uint nblocks, char* src) {
-    INFO("sdspi_multiple_write(%d, %d, %x)", offset, nblocks, src);
     /* Wait until SD card is ready for a new command. */
     while (spi_exchange(0xFF) != 0xFF);
 
-    /* Set block count prior to read with command #23*/
-    char* arg = (void*)&nblocks;
-    char reply, cmd23[] = {23 | (1 << 6), arg[1], arg[0], 0xFF, 0xFF, 0xFF};
-    if (reply = sdspi_exec_cmd(cmd23))
-        FATAL("cmd23 returns status 0x%.2x", reply);
+    /* Send a write request with command #25. */
+    char* arg = (void*)&offset;
+    char reply, cmd25[] = {25 | (1 << 6), arg[3], arg[2], arg[1], arg[0], 0xFF};
+    if (reply = sdspi_exec_cmd(cmd25))
+        FATAL("cmd25 returns status 0x%.2x", reply);
+    spi_exchange(0xFF);
 
-    /* Send a read request with command #18. */
-    arg = (void*)&offset;
-    char cmd18[] = {18 | (1 << 6), arg[3], arg[2], arg[1], arg[0], 0xFF};
-    if (reply = sdspi_exec_cmd(cmd18))
-        FATAL("cmd18 returns status 0x%.2x", reply);
+    /* Send every block in a data packet with token 0xFC and a dummy checksum,
+     * and wait for the card to accept it and finish programming it. */
+    for (uint n = 0; n < nblocks; n++, src += BLOCK_SIZE) {
+        spi_exchange(0xFC);
+        for (uint i = 0; i < BLOCK_SIZE; i++) spi_exchange(src[i]);
+        spi_exchange(0xFF);
+        spi_exchange(0xFF);
+
+        while ((reply = spi_exchange(0xFF)) == 0xFF);
+        if ((reply & 0x1F) != 0x05)
+            FATAL("SD card rejects block #%d with 0x%.2x", offset + n, reply);
+        while (spi_exchange(0xFF) != 0xFF);
+    }
 
-    /* Wait for the data packet and ignore the 2-byte checksum. */
-    while (spi_exchange(0xFF) != 0xFE);
-    for (uint i = 0; i < BLOCK_SIZE; i++) src[i] = spi_exchange(0xFF);
-    spi_exchange(0xFF);
+    /* Stop the transfer with the stop token 0xFD. */
+    spi_exchange(0xFD);
     spi_exchange(0xFF);
+    while (spi_exchange(0xFF) != 0xFF);
 }
 
 static int sdspi_init() {
@@ -269,6 +415,7 @@ void disk_read(uint block_no, uint nblocks, char* dst) {
     if (earth->platform == HARDWARE) {
         sdspi_multiple_read(block_no, nblocks, dst);
     } else {
+        sdhci_wait();
         sdhci_multiple_read(block_no, nblocks, dst);
     }
 
@@ -283,12 +430,51 @@ void disk_write(uint block_no, uint nblocks, char* src) {
     if (earth->platform == HARDWARE) {
         sdspi_multiple_write(block_no, nblocks, src);
     } else {
+        sdhci_wait();
         sdhci_multiple_write(block_no, nblocks, src);
     }
 
     /* Student's code ends here. */
 }
 
+int disk_start(int pid, uint block_no, uint nblocks, char* buf, int write) {
+    /* Start moving the first blocks of buf for process pid and return the
+     * number of blocks in flight, or return 0 if only the process itself
+     * can move them (with the SPI bus, the flash or the software TLB). */
+    if (type == FLASH_ROM || earth->platform == HARDWARE ||
+        earth->translation == SOFT_TLB)
+        return 0;
+    return sdhci_start(pid, block_no, nblocks, buf, write);
+}
+
+int disk_done() {
+    /* Return 1, only once, when the transfer of disk_start() completes. */
+    sdhci_poll();
+    if (!sdhci_done) return 0;
+    sdhci_done = 0;
+    return 1;
+}
+
+#define DISK_BENCH 0 /* set to 1 to measure the throughput at boot time */
+
+static void disk_bench() {
+    /* Measure the sequential throughput with requests of 1 to 256 blocks in
+     * the swap area, which holds nothing at boot time; the buffer is the free
+     * memory, which is not handed out before mmu_init(). */
+    char* buf = (char*)APPS_PAGES_BASE;
+    for (uint n = 1; n <= 256; n *= 4) {
+        ulonglong start = mtime_get();
+        for (uint i = 0; i < 256; i += n) disk_write(SWAP_DISK_START + i, n, buf);
+        uint write_us = mtime_get() - start + 1;
+
+        start = mtime_get();
+        for (uint i = 0; i < 256; i += n) disk_read(SWAP_DISK_START + i, n, buf);
+        uint read_us = mtime_get() - start + 1;
+        INFO("disk_bench: %d-block requests read %d KB/s and write %d KB/s", n,
+             128 * 1000000 / read_us, 128 * 1000000 / write_us);
+    }
+}
+
 void disk_test() {
     int nblocks = 8;
     char wbuf[BLOCK_SIZE * nblocks], rbuf[BLOCK_SIZE * nblocks];
@@ -312,12 +498,15 @@ void disk_test() {
 
     SUCCESS("disk_test: successful multi block read/write");
 
+    if (DISK_BENCH && type == SD_CARD) disk_bench();
 }
 
 void disk_init() {
     earth->disk_read  = disk_read;
     earth->disk_write = disk_write;
-    earth->disk_test = disk_test;
+    earth->disk_test  = disk_test;
+    earth->disk_start = disk_start;
+    earth->disk_done  = disk_done;
 
     if (earth->platform == QEMU) {
         /* QEMU uses the PCI bus and the SDHCI standard. */
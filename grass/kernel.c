@@ -8,6 +8,7 @@
  */
 
 #include "process.h"
+#include "disk.h"
 #include <string.h>
 
 uint core_in_kernel;
@@ -43,11 +44,34 @@ void kernel_entry() {
     memcpy((void*)(EGOS_STACK_TOP - 32 * 4), curr_saved, 32 * 4);
 }
 
+#define INTR_ID_SOFT    3
 #define INTR_ID_TIMER   7
+#define INTR_ID_EXTERNAL 11
 #define EXCP_ID_ECALL_U 8
 #define EXCP_ID_ECALL_M 11
+#define EXCP_ID_PAGE_FAULT_I 12
+#define EXCP_ID_PAGE_FAULT_L 13
+#define EXCP_ID_PAGE_FAULT_S 15
 static void proc_yield();
 static void proc_try_syscall(struct process* proc);
+static void proc_disk_poll();
+
+static void proc_send_fault(int type, uint vaddr, uint tag) {
+    /* Send a request to GPID_PROCESS on behalf of the current process, which
+     * is then blocked until GPID_PROCESS replies (see proc_try_recv). */
+    struct proc_request* req = (void*)proc_set[curr_proc_idx].syscall.content;
+    req->type                = type;
+    req->vaddr               = vaddr;
+    req->tag                 = tag;
+
+    proc_set[curr_proc_idx].faulted          = 1;
+    proc_set[curr_proc_idx].syscall.type     = SYS_SEND;
+    proc_set[curr_proc_idx].syscall.receiver = GPID_PROCESS;
+    proc_set[curr_proc_idx].syscall.status   = PENDING;
+    proc_set_pending(curr_pid);
+    proc_try_syscall(&proc_set[curr_proc_idx]);
+    proc_yield();
+}
 
 static void excp_entry(uint id) {
     if (id >= EXCP_ID_ECALL_U && id <= EXCP_ID_ECALL_M) {
@@ -62,19 +86,25 @@ static void excp_entry(uint id) {
         proc_yield();
         return;
     }
+
+    if (id == EXCP_ID_PAGE_FAULT_I || id == EXCP_ID_PAGE_FAULT_L ||
+        id == EXCP_ID_PAGE_FAULT_S) {
+        /* Resume the process if the MMU resolves the fault (e.g., by copying
+         * a copy-on-write page); the faulting instruction is then retried.
+         * A page mapped lazily is loaded by GPID_PROCESS, the pager. */
+        uint vaddr;
+        asm("csrr %0, mtval" : "=r"(vaddr));
+        int tag = earth->mmu_fault(curr_pid, vaddr, id);
+        if (tag == 0) return;
+        if (tag > 0 && curr_pid >= GPID_USER_START)
+            return proc_send_fault(PROC_PAGEIN, vaddr, tag);
+    }
     /* Student's code goes here (System Call & Protection | Virtual Memory). */
-    
+
     /* Kill the current process if curr_pid is a user application. */
     if (curr_pid >= GPID_USER_START) {
         INFO("process %d terminated with exception %d", curr_pid, id);
-
-        // @TODO: not sure if this is correct but calling proc_free directly seems to make shell hang
-        struct proc_request req;
-        req.type = PROC_EXIT;
-        sys_send(GPID_PROCESS, (void*)&req, sizeof(req));
-
-        proc_yield();
-        return;
+        return proc_send_fault(PROC_EXIT, 0, 0);
     }
 
     /* Student's code ends here. */
@@ -91,6 +121,15 @@ static void intr_entry(uint id) {
     /* Student's code ends here. */
 
     if (id == INTR_ID_TIMER) return proc_yield();
+    if (id == INTR_ID_SOFT) return earth->mmu_shootdown();
+    if (id == INTR_ID_EXTERNAL) {
+        /* The SD card is the only device enabled in the PLIC, and another
+         * core may have claimed the interrupt already (irq is 0). */
+        uint irq = earth->intr_claim(core_in_kernel);
+        proc_disk_poll();
+        if (irq) earth->intr_complete(core_in_kernel, irq);
+        return proc_yield();
+    }
 
     /* Student's code goes here (Ethernet & TCP/IP). */
 
@@ -175,6 +214,8 @@ static void proc_yield() {
             * Enable interrupts by setting the mstatus.MIE bit to 1;
             * Wait for the next interrupt using the wfi instruction. */
            release(kernel_lock);
+           /* Zero the released pages while there is nothing to run. */
+           earth->mmu_zero_idle();
            curr_proc_idx = 0;
            earth->timer_reset(core_in_kernel);
            asm("wfi");
@@ -182,14 +223,14 @@ static void proc_yield() {
     }
     /* Student's code ends here. */
     curr_proc_idx = next_idx;
+    /* mmu_switch flushes the TLB and caches only when necessary. */
     earth->mmu_switch(curr_pid);
-    earth->mmu_flush_cache();
 
     if (curr_status == PROC_READY) {
-        /* Setup argc, argv and program counter for a newly created process. */
-        curr_saved[0]                = APPS_ARG;
-        curr_saved[1]                = APPS_ARG + 4;
-        proc_set[curr_proc_idx].mepc = APPS_ENTRY;
+        /* Setup argc and argv for a newly created process; the program
+         * counter is set by proc_alloc() or proc_set_entry(). */
+        curr_saved[0] = APPS_ARG;
+        curr_saved[1] = APPS_ARG + 4;
     }
     proc_set_running(curr_pid);
     earth->timer_reset(core_in_kernel);
@@ -222,13 +263,104 @@ static void proc_try_send(struct process* sender) {
 static void proc_try_recv(struct process* receiver) {
     if (receiver->syscall.status == PENDING) return;
 
-    /* Copy the system call struct from the kernel back to user space. */
-    uint syscall_paddr = earth->mmu_translate(receiver->pid, SYSCALL_ARG);
-    memcpy((void*)syscall_paddr, &receiver->syscall, sizeof(struct syscall));
+    /* Copy the system call struct from the kernel back to user space,
+     * unless this is the reply to a request sent by proc_send_fault(). */
+    if (receiver->faulted) {
+        receiver->faulted = 0;
+    } else {
+        uint syscall_paddr = earth->mmu_translate(receiver->pid, SYSCALL_ARG);
+        memcpy((void*)syscall_paddr, &receiver->syscall, sizeof(struct syscall));
+    }
 
     /* Set the receiver and sender back to RUNNABLE. */
     proc_set_runnable(receiver->pid);
-    proc_set_runnable(receiver->syscall.sender);
+    for (uint i = 0; i <= MAX_NPROCESS; i++) {
+        struct process* sender = &proc_set[i];
+        if (sender->pid != receiver->syscall.sender ||
+            sender->status == PROC_UNUSED)
+            continue;
+
+        if (sender->faulted) {
+            /* The faulting process now waits for the reply. */
+            sender->syscall.type   = SYS_RECV;
+            sender->syscall.sender = receiver->pid;
+            sender->syscall.status = PENDING;
+        } else {
+            proc_set_runnable(sender->pid);
+        }
+    }
+}
+
+static void proc_try_fork(struct process* parent) {
+    int child_pid = proc_alloc();
+    struct process* child;
+    for (uint i = 1; i <= MAX_NPROCESS; i++)
+        if (proc_set[i].pid == child_pid) child = &proc_set[i];
+
+    /* The child resumes right after the ecall with the same registers. */
+    if (earth->mmu_fork(parent->pid, child_pid) < 0) {
+        child->status              = PROC_UNUSED;
+        parent->saved_registers[0] = -1;
+    } else {
+        child->mepc = parent->mepc;
+        memcpy(child->saved_registers, parent->saved_registers, 32 * 4);
+        child->saved_registers[0]  = 0;
+        parent->saved_registers[0] = child_pid;
+        *(int*)earth->mmu_translate(child_pid, APPS_PID) = child_pid;
+        child->setup_time_microseconds = mtime_get() - child->creation_time;
+        proc_set_runnable(child_pid);
+    }
+    proc_set_runnable(parent->pid);
+}
+
+/* Disk requests (SYS_DISK) are served in arrival order; the one at the head
+ * of disk_queue has disk_nblocks blocks in flight, and each process stays
+ * blocked until all its blocks are moved. */
+static struct process* disk_queue[MAX_NPROCESS];
+static uint disk_head, disk_tail, disk_nblocks;
+
+static void proc_disk_poll() {
+    /* Complete the transfer in flight, and then start the next one. */
+    if (disk_nblocks && !earth->disk_done()) return;
+
+    while (disk_head != disk_tail) {
+        struct process* proc     = disk_queue[disk_head % MAX_NPROCESS];
+        struct disk_request* req = (void*)proc->syscall.content;
+        req->block_no += disk_nblocks;
+        req->buf += disk_nblocks * BLOCK_SIZE;
+        req->nblocks -= disk_nblocks;
+
+        disk_nblocks = 0;
+        if (req->nblocks)
+            disk_nblocks = earth->disk_start(proc->pid, req->block_no,
+                                             req->nblocks, req->buf, req->write);
+        if (disk_nblocks) return;
+
+        /* Return the number of blocks that the process needs to move by
+         * itself, which is 0 unless disk_start() cannot move them. */
+        proc->saved_registers[0] = req->nblocks;
+        proc->syscall.status     = DONE;
+        proc_set_runnable(proc->pid);
+        disk_head++;
+    }
+}
+
+static void proc_try_disk(struct process* proc) {
+    for (uint i = disk_head; i != disk_tail; i++)
+        if (disk_queue[i % MAX_NPROCESS] == proc) return proc_disk_poll();
+    disk_queue[disk_tail++ % MAX_NPROCESS] = proc;
+    proc_disk_poll();
+}
+
+static void proc_try_mmu(struct process* proc) {
+    /* Pages are allocated and mapped only with the kernel lock held, and
+     * only system processes may ask for it. */
+    struct mmu_request* req  = (void*)proc->syscall.content;
+    proc->saved_registers[0] = -1;
+    if (proc->pid < GPID_USER_START)
+        proc->saved_registers[0] = earth->mmu_syscall(
+            req->op, req->args[0], req->args[1], req->args[2]);
+    proc_set_runnable(proc->pid);
 }
 
 static void proc_try_syscall(struct process* proc) {
@@ -239,6 +371,15 @@ static void proc_try_syscall(struct process* proc) {
     case SYS_SEND:
         proc_try_send(proc);
         break;
+    case SYS_FORK:
+        proc_try_fork(proc);
+        break;
+    case SYS_DISK:
+        proc_try_disk(proc);
+        break;
+    case SYS_MMU:
+        proc_try_mmu(proc);
+        break;
     default:
         FATAL("proc_try_syscall: unknown syscall type=%d", proc->syscall.type);
     }
@@ -18,7 +18,21 @@ static void proc_set_status(int pid, enum proc_status status) {
         if (proc_set[i].pid == pid) proc_set[i].status = status;
 }
 
-void proc_set_ready(int pid) { proc_set_status(pid, PROC_READY); }
+void proc_set_ready(int pid) {
+    proc_set_status(pid, PROC_READY);
+    /* The spawn latency is reported with the lifecycle statistics. */
+    for (uint i = 1; i <= MAX_NPROCESS; i++)
+        if (proc_set[i].pid == pid)
+            proc_set[i].setup_time_microseconds =
+                mtime_get() - proc_set[i].creation_time;
+}
+
+void proc_set_entry(int pid, uint entry) {
+    /* A position-independent app may be loaded away from APPS_ENTRY. */
+    for (uint i = 1; i <= MAX_NPROCESS; i++)
+        if (proc_set[i].pid == pid) proc_set[i].mepc = entry;
+}
+
 void proc_set_running(int pid) { proc_set_status(pid, PROC_RUNNING); }
 void proc_set_runnable(int pid) { proc_set_status(pid, PROC_RUNNABLE); }
 void proc_set_pending(int pid) { proc_set_status(pid, PROC_PENDING_SYSCALL); }
@@ -29,6 +43,7 @@ int proc_alloc() {
         if (proc_set[i].status == PROC_UNUSED) {
             proc_set[i].pid    = ++curr_pid;
             proc_set[i].status = PROC_LOADING;
+            proc_set[i].mepc   = APPS_ENTRY;
             /* Student's code goes here (Preemptive Scheduler | System Call). */
 
             /* Initialization of lifecycle statistics, MLFQ or process sleep. */
@@ -43,6 +58,8 @@ int proc_alloc() {
             proc_set[i].sleep_until = 0;
 
             /* Student's code ends here. */
+            proc_set[i].faulted = 0;
+            proc_set[i].setup_time_microseconds = 0;
             return curr_pid;
         }
 
@@ -60,12 +77,13 @@ void print_lifecycle_statistics(int pid) {
         }
     }
     
-    printf("Process %d terminated after %d timer interrupts, turnaround time: %dms, response time: %dms, CPU time: %dms\r\n",
+    printf("Process %d terminated after %d timer interrupts, turnaround time: %dms, response time: %dms, CPU time: %dms, spawn/fork time: %dus\r\n",
         pid,
         current->interrupt_count,
         (termination_time - current->creation_time) / 1000,
         current->response_time_microseconds / 1000,
-        current->cpu_time_microseconds / 1000
+        current->cpu_time_microseconds / 1000,
+        current->setup_time_microseconds
     );
 }
 
@@ -74,7 +92,12 @@ void proc_free(int pid) {
 
     /* Print the lifecycle statistics of the terminated process or processes. */
     if (pid != GPID_ALL) {
+        /* Report the exit latency, which depends on the memory of pid. */
+        ulonglong mmu_free_start = mtime_get();
         earth->mmu_free(pid);
+        if (pid >= GPID_USER_START)
+            INFO("process %d freed in %dus", pid,
+                 (int)(mtime_get() - mmu_free_start));
         proc_set_status(pid, PROC_UNUSED);
         print_lifecycle_statistics(pid);
     } else {
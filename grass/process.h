@@ -30,6 +30,9 @@ struct process {
 
     int sleep_until;
     /* Student's code ends here. */
+
+    int faulted; /* waiting for GPID_PROCESS to handle a fault */
+    int setup_time_microseconds; /* from proc_alloc to spawned or forked */
 };
 #define MAX_NPROCESS 16
 
@@ -38,6 +41,7 @@ ulonglong mtime_get();
 int proc_alloc();
 void proc_free(int);
 void proc_set_ready(int);
+void proc_set_entry(int, uint);
 void proc_set_running(int);
 void proc_set_runnable(int);
 void proc_set_pending(int);
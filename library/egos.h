@@ -8,12 +8,24 @@ typedef unsigned long long ulonglong;
 struct earth {
     uint (*mmu_alloc)();
     void (*mmu_free)(int pid);
+    uint (*mmu_alloc_pages)(uint order); /* 2^order contiguous pages */
+    void (*mmu_free_pages)(uint ppage_id, uint order);
+    uint (*mmu_alloc_zeroed)();
+    void (*mmu_zero_idle)(); /* zero the released pages on an idle core */
     void (*mmu_flush_cache)();
     void (*timer_reset)(uint core_id);
+    uint (*intr_claim)(uint core_id); /* claim an external interrupt */
+    void (*intr_complete)(uint core_id, uint irq);
 
     void (*mmu_map)(int pid, uint vpage_no, uint ppage_id);
+    void (*mmu_map_zero)(int pid, uint vpage_no);
+    void (*mmu_map_lazy)(int pid, uint vpage_no, uint tag);
     uint (*mmu_translate)(int pid, uint vaddr);
     void (*mmu_switch)(int pid);
+    int (*mmu_fork)(int src_pid, int dst_pid);
+    int (*mmu_fault)(int pid, uint vaddr, uint mcause);
+    void (*mmu_shootdown)(); /* handle a TLB shootdown (software interrupt) */
+    uint (*mmu_syscall)(uint op, uint arg0, uint arg1, uint arg2);
 
     void (*tty_read)(char* c);
     void (*tty_write)(char c);
@@ -21,6 +33,11 @@ struct earth {
     void (*disk_read)(uint block_no, uint nblocks, char* dst);
     void (*disk_write)(uint block_no, uint nblocks, char* src);
     void (*disk_test)();
+    /* Start a DMA transfer for process pid in the background, and poll for
+     * its completion; see grass/kernel.c for the disk request queue. */
+    int (*disk_start)(int pid, uint block_no, uint nblocks, char* buf,
+                      int write);
+    int (*disk_done)();
 
     enum { HARDWARE, QEMU } platform;
     enum { PAGE_TABLE, SOFT_TLB } translation;
@@ -30,9 +47,12 @@ struct grass {
     int (*proc_alloc)();
     void (*proc_free)(int pid);
     void (*proc_set_ready)(int pid);
+    void (*proc_set_entry)(int pid, uint entry);
 
     void (*sys_send)(int receiver, char* msg, uint size);
     void (*sys_recv)(int from, int* sender, char* buf, uint size);
+    void (*sys_disk)(uint block_no, uint nblocks, char* buf, int write);
+    uint (*sys_mmu)(uint op, uint arg0, uint arg1, uint arg2);
     /* Student's code goes here (System Call | Multicore & Locks). */
 
     /* Add interface functions for process sleep and multicore information. */
@@ -51,6 +71,7 @@ extern struct grass* grass;
 #define APPS_STACK_TOP  0x80400000UL /* 1MB app stack (growing down)     */
 #define SHELL_WORK_DIR  0x80302000UL /* current work directory for shell */
 #define SYSCALL_ARG     0x80301000UL /* struct syscall                   */
+#define APPS_PID        0x80300FFCUL /* pid, the last word of APPS_ARG   */
 #define APPS_ARG        0x80300000UL /* main() arguments (argc and argv) */
 #define APPS_ENTRY      0x80200000UL /* 1MB app code and data            */
 #define EGOS_STACK_TOP  0x80200000UL /* 1MB egos stack (growing down)    */
@@ -58,6 +79,10 @@ extern struct grass* grass;
 #define EARTH_STRUCT    0x80100000UL /* struct earth                     */
 #define RAM_START       0x80000000UL /* 1MB egos code and data           */
 
+/* Below is the virtual memory layout of anonymous memory for user apps. */
+#define APPS_MMAP_END   0x61000000UL /* 16MB mapped by mmap_anon() and   */
+#define APPS_MMAP_BASE  0x60000000UL /* allocated on the first access    */
+
 /* Below is the memory-mapped I/O layout in egos-2000. */
 #define SDHCI_PCI_ECAM   0x30008000UL /* QEMU     */
 #define SDHCI_BASE       0x40000000UL /* QEMU     */
@@ -93,6 +118,12 @@ int SUCCESS(const char* format, ...);
 int CRITICAL(const char* format, ...);
 int my_printf(const char* format, ...);
 
+/* Copy, zero or compare one page (see library/libc/string.c); page_diff()
+ * returns the offset of the first different word, or 4096. */
+void page_copy(void* dst, const void* src);
+void page_zero(void* dst);
+uint page_diff(const void* a, const void* b);
+
 /* Student's code goes here (Ethernet & TCP/IP). */
 
 /* Define a data structure for Ethernet's RX descriptors. Declare the RX buffers
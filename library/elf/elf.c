@@ -14,46 +14,164 @@
 #define PAGE_SIZE          4096
 #define PAGE_ID_TO_ADDR(x) ((char*)APPS_PAGES_BASE + x * PAGE_SIZE)
 
-void elf_load(int pid, elf_reader reader, int argc, void** argv) {
+/* With demand paging, the user stack grows on page faults up to this limit. */
+#ifndef APPS_STACK_NPAGES
+#define APPS_STACK_NPAGES 64
+#endif
+
+/* With the software TLB, a position-independent app is loaded at a slot of
+ * the apps region chosen by its pid, so switching between apps only copies
+ * the pages which overlap; the first 2 slots are left to system processes. */
+#define PIE_SLOT_SIZE  0x20000
+#define PIE_SLOT_FIRST 2
+#define PIE_NSLOTS     6
+
+/* The pages of the app being loaded, indexed from its link address. */
+static uint elf_pages[(APPS_ARG - APPS_ENTRY) / PAGE_SIZE];
+
+static uint elf_load_page(elf_reader reader, struct elf32_program_header* seg,
+                          uint page_no) {
+    /* Allocate one page (4KB) and fill it with its 8 blocks (512 bytes) from
+     * the file with one read; the part of the page beyond p_filesz is left as
+     * zero. The caller maps the page once it is filled, so it cannot be
+     * swapped out while the file is being read. */
+    uint ppage_id = earth->mmu_alloc_zeroed();
+
+    /* Segments are page-aligned by library/elf/app.lds. */
+    uint start = page_no * PAGE_SIZE - seg->p_vaddr;
+    if (start >= seg->p_filesz) return ppage_id;
+    uint size = seg->p_filesz - start;
+    if (size > PAGE_SIZE) size = PAGE_SIZE;
+
+    char* page = PAGE_ID_TO_ADDR(ppage_id);
+    reader((seg->p_offset + start) / BLOCK_SIZE,
+           (size + BLOCK_SIZE - 1) / BLOCK_SIZE, page);
+    /* Clear the rest of the last block read, which is beyond p_filesz. */
+    memset(page + size, 0, (PAGE_SIZE - size) % BLOCK_SIZE);
+    return ppage_id;
+}
+
+static uint elf_read_block_no;
+
+static void elf_read(elf_reader reader, uint off, void* dst, uint len) {
+    /* Read len bytes at offset off of the file, caching the last block. */
+    static char buf[BLOCK_SIZE];
+    for (uint i = 0; i < len; i++, off++) {
+        if (off / BLOCK_SIZE != elf_read_block_no) {
+            elf_read_block_no = off / BLOCK_SIZE;
+            reader(elf_read_block_no, 1, buf);
+        }
+        ((char*)dst)[i] = buf[off % BLOCK_SIZE];
+    }
+}
+
+static uint elf_file_offset(struct elf32_header* header,
+                            struct elf32_program_header* pheader, uint addr) {
+    for (uint i = 0; i < header->e_phnum; i++)
+        if (pheader[i].p_type == PT_LOAD && addr >= pheader[i].p_vaddr &&
+            addr < pheader[i].p_vaddr + pheader[i].p_filesz)
+            return addr - pheader[i].p_vaddr + pheader[i].p_offset;
+    FATAL("elf_file_offset: 0x%x is not in the file", addr);
+}
+
+static void elf_relocate(elf_reader reader, struct elf32_header* header,
+                         struct elf32_program_header* pheader, uint delta,
+                         uint page_no, uint ppage_id) {
+    /* Relocate one page of a position-independent app, or every page in
+     * elf_pages if page_no is -1; relocations are applied even if delta is 0
+     * since the linker may not fill in the words they point to. */
+    if (header->e_type != ET_DYN) return;
+
+    /* Find the relocation table in the dynamic segment. */
+    uint rela = 0, relasz = 0;
+    elf_read_block_no = -1;
+    for (uint i = 0; i < header->e_phnum; i++) {
+        if (pheader[i].p_type != PT_DYNAMIC) continue;
+        uint ndyn = pheader[i].p_filesz / sizeof(struct elf32_dynamic);
+        for (uint j = 0; j < ndyn; j++) {
+            struct elf32_dynamic dyn;
+            elf_read(reader, pheader[i].p_offset + j * sizeof(dyn), &dyn,
+                     sizeof(dyn));
+            if (dyn.d_tag == DT_RELA) rela = dyn.d_val;
+            if (dyn.d_tag == DT_RELASZ) relasz = dyn.d_val;
+        }
+    }
+
+    /* Add delta to every word holding a link-time address. */
+    uint rela_off = relasz ? elf_file_offset(header, pheader, rela) : 0;
+    for (uint off = 0; off < relasz; off += sizeof(struct elf32_rela)) {
+        struct elf32_rela r;
+        elf_read(reader, rela_off + off, &r, sizeof(r));
+        if ((r.r_info & 0xFF) != R_RISCV_RELATIVE)
+            FATAL("elf_relocate: relocation type %d", r.r_info & 0xFF);
+
+        if (page_no == -1)
+            ppage_id = elf_pages[(r.r_offset - APPS_ENTRY) / PAGE_SIZE];
+        else if (r.r_offset / PAGE_SIZE != page_no)
+            continue;
+        *(uint*)(PAGE_ID_TO_ADDR(ppage_id) + r.r_offset % PAGE_SIZE) =
+            r.r_addend + delta;
+    }
+}
+
+static uint elf_load_image(int pid, elf_reader reader, uint tag, int argc,
+                           void** argv) {
     /* Load the ELF header. */
-    char hbuf[BLOCK_SIZE], buf[BLOCK_SIZE];
-    reader(0, hbuf);
+    char hbuf[BLOCK_SIZE];
+    reader(0, 1, hbuf);
     struct elf32_header* header          = (void*)hbuf;
     struct elf32_program_header* pheader = (void*)(hbuf + header->e_phoff);
 
+    /* Choose the slot of a position-independent app; apps are linked at
+     * APPS_ENTRY, and delta is the distance to where they are loaded. */
+    uint delta = 0, image_end = APPS_ENTRY;
+    for (uint i = 0; i < header->e_phnum; i++)
+        if (pheader[i].p_type == PT_LOAD &&
+            pheader[i].p_vaddr + pheader[i].p_memsz > image_end)
+            image_end = pheader[i].p_vaddr + pheader[i].p_memsz;
+    if (!tag && earth->translation == SOFT_TLB && pid >= GPID_USER_START &&
+        header->e_type == ET_DYN && image_end - APPS_ENTRY <= PIE_SLOT_SIZE)
+        delta = PIE_SLOT_SIZE * (PIE_SLOT_FIRST + pid % PIE_NSLOTS);
+
     /* Load the code and data memory regions. */
+    uint heap_pageno = APPS_ENTRY / PAGE_SIZE;
     for (uint i = 0; i < header->e_phnum; i++) {
         uint addr = pheader[i].p_vaddr;
-        if (addr < RAM_START) continue;
-
-        uint memsz        = pheader[i].p_memsz;
-        uint filesz       = pheader[i].p_filesz;
-        uint curr_pageno  = addr / PAGE_SIZE;
-        uint end_pageno   = (addr + memsz) / PAGE_SIZE;
-        uint curr_blockno = pheader[i].p_offset / BLOCK_SIZE;
-        for (uint ppage_id, off = 0; off < filesz; off += BLOCK_SIZE) {
-            /* Allocate one page (4KB) for every 8 blocks (512 bytes). */
-            if (off % PAGE_SIZE == 0) {
-                ppage_id = earth->mmu_alloc();
-                earth->mmu_map(pid, curr_pageno++, ppage_id);
-                memset(PAGE_ID_TO_ADDR(ppage_id), 0, PAGE_SIZE);
+        if (pheader[i].p_type != PT_LOAD || addr < RAM_START) continue;
+
+        uint memsz       = pheader[i].p_memsz;
+        uint filesz      = pheader[i].p_filesz;
+        uint curr_pageno = addr / PAGE_SIZE;
+        uint file_pageno = (addr + filesz + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint end_pageno  = (addr + memsz + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        /* With a tag, pages are read from the file on the first access. */
+        for (; curr_pageno < file_pageno; curr_pageno++) {
+            if (tag) {
+                earth->mmu_map_lazy(pid, curr_pageno, tag);
+                continue;
             }
-            uint size =
-                (off + BLOCK_SIZE < filesz) ? BLOCK_SIZE : (filesz - off);
-            reader(curr_blockno++, buf);
-            memcpy(PAGE_ID_TO_ADDR(ppage_id) + (off % PAGE_SIZE), buf, size);
+            uint ppage_id = elf_load_page(reader, &pheader[i], curr_pageno);
+            earth->mmu_map(pid, curr_pageno + delta / PAGE_SIZE, ppage_id);
+            elf_pages[curr_pageno - APPS_ENTRY / PAGE_SIZE] = ppage_id;
         }
 
-        while (curr_pageno < end_pageno) {
-            uint ppage_id = earth->mmu_alloc();
-            earth->mmu_map(pid, curr_pageno++, ppage_id);
-            memset(PAGE_ID_TO_ADDR(ppage_id), 0, PAGE_SIZE);
-        }
+        /* The bss pages share the zero page until they are written. */
+        for (; curr_pageno < end_pageno; curr_pageno++)
+            earth->mmu_map_zero(pid, curr_pageno + delta / PAGE_SIZE);
+        if (end_pageno > heap_pageno) heap_pageno = end_pageno;
 
         /* Numbers printed should match the numbers in build/debug/sys_*.lst. */
         if (pid <= GPID_SHELL) INFO("Load 0x%x bytes to 0x%x", filesz, addr);
     }
-    
+    if (!tag) elf_relocate(reader, header, pheader, delta, -1, 0);
+
+    /* The heap up to APPS_ARG is anonymous memory allocated on the first
+     * access (see _sbrk in library/libc/malloc.c). */
+    if (tag)
+        for (; heap_pageno < APPS_ARG / PAGE_SIZE; heap_pageno++)
+            earth->mmu_map_lazy(pid, heap_pageno, 0);
+
     /* Setup a page for main() arguments (argc and argv). */
     uint ppage_id = earth->mmu_alloc();
     earth->mmu_map(pid, APPS_ARG / PAGE_SIZE, ppage_id);
@@ -62,8 +180,9 @@ void elf_load(int pid, elf_reader reader, int argc, void** argv) {
     int* argv_addr = argc_addr + 1;
     int* args_addr = argv_addr + CMD_NARGS;
     
-    /* Initialize argc and argv. */
+    /* Initialize argc and argv, and the pid at APPS_PID. */
     *argc_addr = argc;
+    *(int*)((char*)argc_addr + (APPS_PID - APPS_ARG)) = pid;
     if (argv) memcpy(args_addr, argv, argc * CMD_ARG_LEN);
     for (uint i = 0; i < argc; i++)
     argv_addr[i] = APPS_ARG + sizeof(uint) /* argc */ +
@@ -73,9 +192,55 @@ void elf_load(int pid, elf_reader reader, int argc, void** argv) {
     ppage_id = earth->mmu_alloc();
     earth->mmu_map(pid, SYSCALL_ARG / PAGE_SIZE, ppage_id);
     
-    /* Setup 2 pages for user stack (enough for teaching purpose). */
-    for (uint i = 1; i <= 2; i++) {
+    /* Setup 2 pages for user stack (enough for teaching purpose), or let the
+     * stack grow on demand up to APPS_STACK_NPAGES with a tag. */
+    for (uint i = 1; i <= (tag ? APPS_STACK_NPAGES : 2); i++) {
+        if (tag) {
+            earth->mmu_map_lazy(pid, APPS_STACK_TOP / PAGE_SIZE - i, 0);
+            continue;
+        }
         ppage_id = earth->mmu_alloc();
         earth->mmu_map(pid, APPS_STACK_TOP / PAGE_SIZE - i, ppage_id);
     }
+    return header->e_entry + delta;
+}
+
+uint elf_load(int pid, elf_reader reader, int argc, void** argv) {
+    return elf_load_image(pid, reader, 0, argc, argv);
+}
+
+uint elf_load_lazy(int pid, elf_reader reader, uint tag, int argc,
+                   void** argv) {
+    /* Demand paging relies on page faults, so the software TLB loads all. */
+    if (earth->translation == SOFT_TLB) tag = 0;
+    return elf_load_image(pid, reader, tag, argc, argv);
+}
+
+int elf_pagein(int pid, elf_reader reader, uint tag, uint vaddr) {
+    /* Keep the ELF header of the last file, which is likely paged in again. */
+    static char hbuf[BLOCK_SIZE];
+    static uint hbuf_tag;
+    if (hbuf_tag != tag) {
+        reader(0, 1, hbuf);
+        hbuf_tag = tag;
+    }
+    struct elf32_header* header          = (void*)hbuf;
+    struct elf32_program_header* pheader = (void*)(hbuf + header->e_phoff);
+
+    /* The last file page of a segment is tagged by elf_load_image() too,
+     * and holds the start of .bss past p_filesz, which elf_load_page() leaves
+     * as zero; so the range ends at the page-rounded end of the file part. */
+    for (uint i = 0; i < header->e_phnum; i++) {
+        uint addr = pheader[i].p_vaddr;
+        uint end  = addr + pheader[i].p_filesz;
+        end       = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if (pheader[i].p_type != PT_LOAD || addr < RAM_START || vaddr < addr ||
+            vaddr >= end)
+            continue;
+        uint ppage_id = elf_load_page(reader, &pheader[i], vaddr / PAGE_SIZE);
+        elf_relocate(reader, header, pheader, 0, vaddr / PAGE_SIZE, ppage_id);
+        earth->mmu_map(pid, vaddr / PAGE_SIZE, ppage_id);
+        return 0;
+    }
+    return -1;
 }
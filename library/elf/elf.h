@@ -28,5 +28,30 @@ struct elf32_program_header {
     uint p_align;
 };
 
-typedef void (*elf_reader)(uint block_no, char* dst);
-void elf_load(int pid, elf_reader reader, int argc, void** argv);
+/* Position-independent apps (ET_DYN) only have R_RISCV_RELATIVE relocations
+ * which are listed by DT_RELA and DT_RELASZ in the PT_DYNAMIC segment. */
+#define ET_DYN           3
+#define PT_LOAD          1
+#define PT_DYNAMIC       2
+#define DT_RELA          7
+#define DT_RELASZ        8
+#define R_RISCV_RELATIVE 3
+
+struct elf32_dynamic {
+    int d_tag;
+    uint d_val;
+};
+
+struct elf32_rela {
+    uint r_offset;
+    uint r_info;
+    int r_addend;
+};
+
+/* elf_load and elf_load_lazy return the entry address of the loaded app. */
+/* An elf_reader reads nblocks blocks of the file starting at block_no. */
+typedef void (*elf_reader)(uint block_no, uint nblocks, char* dst);
+uint elf_load(int pid, elf_reader reader, int argc, void** argv);
+uint elf_load_lazy(int pid, elf_reader reader, uint tag, int argc,
+                   void** argv);
+int elf_pagein(int pid, elf_reader reader, uint tag, uint vaddr);
@@ -0,0 +1,202 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: a write-back block cache stacked on another inode store
+ * cache_init(below, nblocks) caches up to nblocks blocks of any inode of the
+ * inode store below. Blocks are replaced with the CLOCK algorithm, and written
+ * blocks stay dirty in the cache until they are evicted or cache_sync().
+ */
+
+#include "egos.h"
+#include "inode.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct cache_entry {
+    int ino; /* -1 if the entry is unused */
+    uint offset;
+    char referenced, dirty;
+    int next; /* the next entry in the same hash bucket, or -1 */
+    block_t block;
+};
+
+struct cache_state {
+    inode_intf below;
+    uint nblocks, hand, ndirty;
+    int* buckets; /* nblocks hash buckets of entry indices */
+    struct cache_entry* entries;
+    uint hits, misses, writebacks;
+};
+
+#define CACHE_HASH(cs, ino, offset) (((ino) * 31 + (offset)) % (cs)->nblocks)
+
+static int cache_lookup(struct cache_state* cs, uint ino, uint offset) {
+    for (int i = cs->buckets[CACHE_HASH(cs, ino, offset)]; i >= 0;
+         i = cs->entries[i].next)
+        if (cs->entries[i].ino == ino && cs->entries[i].offset == offset)
+            return i;
+    return -1;
+}
+
+static void cache_unlink(struct cache_state* cs, int idx) {
+    int* link = &cs->buckets[CACHE_HASH(cs, cs->entries[idx].ino,
+                                        cs->entries[idx].offset)];
+    while (*link != idx) link = &cs->entries[*link].next;
+    *link                  = cs->entries[idx].next;
+    cs->entries[idx].ino   = -1;
+    cs->entries[idx].dirty = 0;
+}
+
+static int cache_writeback(struct cache_state* cs, struct cache_entry* e) {
+    if (!e->dirty) return 0;
+    e->dirty = 0;
+    cs->ndirty--;
+    cs->writebacks++;
+    return cs->below->write(cs->below, e->ino, e->offset, &e->block);
+}
+
+static int cache_evict(struct cache_state* cs, uint ino, uint offset) {
+    /* Advance the clock hand, giving referenced entries a second chance. */
+    while (1) {
+        int idx               = cs->hand;
+        struct cache_entry* e = &cs->entries[idx];
+        cs->hand              = (cs->hand + 1) % cs->nblocks;
+        if (e->ino >= 0 && e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+
+        if (e->ino >= 0) {
+            if (cache_writeback(cs, e) < 0) return -1;
+            cache_unlink(cs, idx);
+        }
+        uint bucket         = CACHE_HASH(cs, ino, offset);
+        e->ino              = ino;
+        e->offset           = offset;
+        e->referenced       = 1;
+        e->next             = cs->buckets[bucket];
+        cs->buckets[bucket] = idx;
+        return idx;
+    }
+}
+
+static int cache_getsize(inode_intf self, uint ino) {
+    struct cache_state* cs = self->state;
+    return cs->below->getsize(cs->below, ino);
+}
+
+static int cache_setsize(inode_intf self, uint ino, uint newsize) {
+    /* Drop the cached blocks beyond the new size without writing them. */
+    struct cache_state* cs = self->state;
+    for (uint i = 0; i < cs->nblocks; i++) {
+        struct cache_entry* e = &cs->entries[i];
+        if (e->ino != ino || e->offset < newsize) continue;
+        if (e->dirty) cs->ndirty--;
+        cache_unlink(cs, i);
+    }
+    return cs->below->setsize(cs->below, ino, newsize);
+}
+
+static int cache_read(inode_intf self, uint ino, uint offset, block_t* block) {
+    struct cache_state* cs = self->state;
+    int idx                = cache_lookup(cs, ino, offset);
+    if (idx >= 0) {
+        cs->hits++;
+        cs->entries[idx].referenced = 1;
+    } else {
+        cs->misses++;
+        if ((idx = cache_evict(cs, ino, offset)) < 0) return -1;
+        if (cs->below->read(cs->below, ino, offset, &cs->entries[idx].block) <
+            0) {
+            cache_unlink(cs, idx);
+            return -1;
+        }
+    }
+    memcpy(block, &cs->entries[idx].block, BLOCK_SIZE);
+    return 0;
+}
+
+static int cache_write(inode_intf self, uint ino, uint offset, block_t* block) {
+    /* A write covers the whole block, so a missing block is not read. */
+    struct cache_state* cs = self->state;
+    int idx                = cache_lookup(cs, ino, offset);
+    if (idx >= 0) {
+        cs->hits++;
+        cs->entries[idx].referenced = 1;
+    } else {
+        cs->misses++;
+        if ((idx = cache_evict(cs, ino, offset)) < 0) return -1;
+    }
+    memcpy(&cs->entries[idx].block, block, BLOCK_SIZE);
+    if (!cs->entries[idx].dirty) cs->ndirty++;
+    cs->entries[idx].dirty = 1;
+    return 0;
+}
+
+static int cache_read_range(inode_intf self, uint ino, uint offset,
+                            uint nblocks, block_t* blocks) {
+    /* Read each run of missing blocks from below at once, and cache them. */
+    struct cache_state* cs = self->state;
+    for (uint i = 0, len; i < nblocks; i += len) {
+        int idx = cache_lookup(cs, ino, offset + i);
+        len     = 1;
+        if (idx >= 0) {
+            cs->hits++;
+            cs->entries[idx].referenced = 1;
+            memcpy(&blocks[i], &cs->entries[idx].block, BLOCK_SIZE);
+            continue;
+        }
+
+        while (i + len < nblocks && cache_lookup(cs, ino, offset + i + len) < 0)
+            len++;
+        cs->misses += len;
+        if (inode_read_range(cs->below, ino, offset + i, len, &blocks[i]) < 0)
+            return -1;
+        for (uint j = i; j < i + len; j++) {
+            if ((idx = cache_evict(cs, ino, offset + j)) < 0) return -1;
+            memcpy(&cs->entries[idx].block, &blocks[j], BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+int cache_sync(inode_intf self) {
+    /* Write all the dirty blocks to the inode store below. */
+    struct cache_state* cs = self->state;
+    for (uint i = 0; i < cs->nblocks && cs->ndirty; i++)
+        if (cache_writeback(cs, &cs->entries[i]) < 0) return -1;
+    return 0;
+}
+
+void cache_stats(inode_intf self) {
+    struct cache_state* cs = self->state;
+    uint accesses          = cs->hits + cs->misses;
+    INFO("cache: %d hits, %d misses (%d%% hit rate), %d blocks written back",
+         cs->hits, cs->misses, accesses ? cs->hits * 100 / accesses : 0,
+         cs->writebacks);
+}
+
+inode_intf cache_init(inode_intf below, uint nblocks) {
+    struct cache_state* cs = malloc(sizeof(struct cache_state));
+    memset(cs, 0, sizeof(struct cache_state));
+    cs->below   = below;
+    cs->nblocks = nblocks;
+    cs->buckets = malloc(nblocks * sizeof(int));
+    cs->entries = malloc(nblocks * sizeof(struct cache_entry));
+    memset(cs->entries, 0, nblocks * sizeof(struct cache_entry));
+    for (uint i = 0; i < nblocks; i++) {
+        cs->buckets[i]     = -1;
+        cs->entries[i].ino = -1;
+    }
+
+    inode_intf self = malloc(sizeof(struct inode_store));
+    self->getsize     = cache_getsize;
+    self->setsize     = cache_setsize;
+    self->read        = cache_read;
+    self->write       = cache_write;
+    self->read_range  = cache_read_range;
+    self->write_range = NULL; /* written blocks stay in the cache */
+    self->state       = cs;
+    return self;
+}
@@ -0,0 +1,33 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: the directory format written by tools/mkfs.c
+ * A directory is a hash table of struct dir_entry over the blocks of its
+ * inode. The entry of a name is in block dir_hash(name) % nblocks of the
+ * directory, or in one of the blocks after it (wrapping around) if that one
+ * was full, and the entries of a block are filled from the first one; so a
+ * lookup stops at the first empty entry. mkfs keeps a directory at most half
+ * full, and a lookup usually reads one block.
+ */
+
+#pragma once
+#include "disk.h"
+
+#define DIR_NAME_LEN 28
+struct dir_entry {
+    char name[DIR_NAME_LEN]; /* "" if unused; "name/" for a directory */
+    int ino;
+};
+
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct dir_entry))
+struct dir_block {
+    struct dir_entry entries[DIR_ENTRIES_PER_BLOCK];
+};
+
+static inline unsigned int dir_hash(char* name) {
+    /* The 32-bit FNV-1a hash. */
+    unsigned int hash = 2166136261u;
+    for (; *name; name++) hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
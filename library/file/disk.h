@@ -10,6 +10,8 @@ typedef struct block {
 #define EGOS_BIN_DISK_SIZE   SIZE_2MB
 #define FILE_SYS_DISK_SIZE   SIZE_2MB
 #define FILE_SYS_DISK_START  (EGOS_BIN_DISK_SIZE / BLOCK_SIZE)
+#define SWAP_DISK_SIZE       (SIZE_2MB * 2)
+#define SWAP_DISK_START      (FILE_SYS_DISK_START + FILE_SYS_DISK_SIZE / BLOCK_SIZE)
 #define EGOS_BIN_MAX_NBYTE   (128 * 1024)
 #define SYS_PROC_EXEC_START  (EGOS_BIN_MAX_NBYTE / BLOCK_SIZE) * 1
 #define SYS_TERM_EXEC_START  (EGOS_BIN_MAX_NBYTE / BLOCK_SIZE) * 2
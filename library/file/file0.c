@@ -61,329 +61,217 @@ _Static_assert(sizeof(struct superblock) == 512,
 
 /* Student's code ends here. */
 
+/* The superblock, the inode blocks and the FAT are loaded into memory on the
+ * first access (see mydisk_load) and every change is written through to the
+ * blocks below. fat_cursor remembers where the last access to each inode was
+ * in its chain, so that sequential access follows one FAT entry per block
+ * and random access only walks the chain in memory. */
+static struct inode_block* iblocks;
+static struct fat_table_block* fblocks;
+static struct {
+    uint offset;
+    int entry; /* the FAT entry of block offset, or -1 */
+} fat_cursor[NINODES];
+
+#define INODE(ino)                                                             \
+    (&iblocks[(ino) / INODES_PER_BLOCK].inodes[(ino) % INODES_PER_BLOCK])
+#define FAT(entry)                                                             \
+    (&fblocks[(entry) / FAT_ENTRIES_PER_BLOCK]                                 \
+          .entries[(entry) % FAT_ENTRIES_PER_BLOCK])
+
 int get_inode_block_number(uint ino) {
     return (ino / INODES_PER_BLOCK) + 1; // + 1 for super block
 }
 
-struct inode *get_inode_from_inode_block(uint ino, struct inode_block *block) {
-    return &block->inodes[ino % INODES_PER_BLOCK];
-}
-
 int get_fat_entry_block_number(uint fat_entry) {
     return SB.iblock_count + 1 + (fat_entry / FAT_ENTRIES_PER_BLOCK);
 }
 
-struct entry *get_fat_entry_from_fat_table_block(uint fat_entry_number, struct fat_table_block *block) {
-    return &block->entries[fat_entry_number % FAT_ENTRIES_PER_BLOCK];
-}
-
 int get_data_block_number(uint data_block_number) {
     return data_block_number + SB.iblock_count + SB.fblock_count + 1;
 }
 
-int fat_walk(inode_intf below, int steps, struct entry **fat_entry, struct fat_table_block *fat_block) {
-    int fat_block_number;
-    for (int i = 0; i < steps; i++) {
-        
-        if (*fat_entry == NULL || (*fat_entry)->next < 0) {
-            return -1;
-        }
-
-        fat_block_number = get_fat_entry_block_number((*fat_entry)->next);
-        if(below->read(below, 0, fat_block_number, (block_t *)fat_block) < 0) {
-            return -1;
-        }
+static int mydisk_load(inode_intf below) {
+    if (fblocks) return 0;
+    if (below->read(below, 0, 0, (block_t *)&SB) < 0) return -1;
+
+    iblocks = malloc(SB.iblock_count * BLOCK_SIZE);
+    fblocks = malloc(SB.fblock_count * BLOCK_SIZE);
+    for (int i = 0; i < SB.iblock_count; i++)
+        if (below->read(below, 0, 1 + i, (block_t *)&iblocks[i]) < 0)
+            goto fail;
+    for (int i = 0; i < SB.fblock_count; i++)
+        if (below->read(below, 0, SB.iblock_count + 1 + i,
+                        (block_t *)&fblocks[i]) < 0)
+            goto fail;
+
+    for (int i = 0; i < NINODES; i++) fat_cursor[i].entry = -1;
+    return 0;
 
-        *fat_entry = get_fat_entry_from_fat_table_block((*fat_entry)->next, fat_block);
-    }
+fail:
+    free(iblocks);
+    free(fblocks);
+    fblocks = NULL;
+    return -1;
+}
 
-    return 0;
+static int store_inode(inode_intf below, uint ino) {
+    return below->write(below, 0, get_inode_block_number(ino),
+                        (block_t *)&iblocks[ino / INODES_PER_BLOCK]);
 }
 
-int mydisk_read(inode_intf self, uint ino, uint offset, block_t* block) {
-    /* Student's code goes here (File System). */
+static int store_fat(inode_intf below, uint entry) {
+    return below->write(below, 0, get_fat_entry_block_number(entry),
+                        (block_t *)&fblocks[entry / FAT_ENTRIES_PER_BLOCK]);
+}
 
-    /* Replace the code below with your own file system read logic. */
-    inode_intf below = self->state;
+static int fat_seek(uint ino, uint offset) {
+    /* Return the FAT entry of block offset, which is below the inode size. */
+    uint pos = 0;
+    int entry = INODE(ino)->head;
+    if (ino < NINODES && fat_cursor[ino].entry >= 0 &&
+        fat_cursor[ino].offset <= offset) {
+        pos   = fat_cursor[ino].offset;
+        entry = fat_cursor[ino].entry;
+    }
+    for (; pos < offset; pos++) entry = FAT(entry)->next;
 
-    // Read superblock
-    if (below->read(below, 0, 0, (block_t *)&SB) < 0) {
-        return -1;
+    if (ino < NINODES) {
+        fat_cursor[ino].offset = offset;
+        fat_cursor[ino].entry  = entry;
     }
+    return entry;
+}
 
-    struct inode_block iblock;
-    struct inode *inode_to_read;
+static int mydisk_valid(inode_intf below, uint ino) {
+    if (mydisk_load(below) < 0) return 0;
+    return ino < SB.iblock_count * INODES_PER_BLOCK;
+}
 
-    int inode_block_number = get_inode_block_number(ino);
-    if (below->read(below, 0, inode_block_number, (block_t *)&iblock) < 0) {
-        return -1;
-    } 
+static int mydisk_grow(inode_intf below, uint ino, uint nblocks) {
+    /* Take the blocks from the head of the free list. */
+    struct inode* inode = INODE(ino);
+    int first = SB.head, last = SB.head;
+    for (uint i = inode->size; i < nblocks; i++) {
+        if (last < 0) return -1;
+        if (i + 1 < nblocks) last = FAT(last)->next;
+    }
 
-    inode_to_read = get_inode_from_inode_block(ino, &iblock);
-    if (offset >= inode_to_read->size) {
-        return -1;
+    SB.head = FAT(last)->next;
+    FAT(last)->next = -1;
+    if (store_fat(below, last) < 0) return -1;
+
+    if (inode->size == 0) {
+        inode->head = first;
+    } else {
+        int tail = fat_seek(ino, inode->size - 1);
+        FAT(tail)->next = first;
+        if (store_fat(below, tail) < 0) return -1;
     }
+    inode->size = nblocks;
 
-    struct fat_table_block  fat_block;
-    struct entry            dummy_entry = {.next = inode_to_read->head};
-    struct entry            *fat_entry = &dummy_entry;
-    uint                    fat_block_number;
+    if (store_inode(below, ino) < 0) return -1;
+    return below->write(below, 0, 0, (block_t *)&SB);
+}
 
-    if (fat_walk(below, offset, &fat_entry, &fat_block) < 0) {
-        return -1;
+static int mydisk_shrink(inode_intf below, uint ino, uint nblocks) {
+    /* Put the blocks beyond nblocks back to the head of the free list. */
+    struct inode* inode = INODE(ino);
+    int first, last = fat_seek(ino, inode->size - 1);
+    if (nblocks == 0) {
+        first       = inode->head;
+        inode->head = -1;
+    } else {
+        int tail        = fat_seek(ino, nblocks - 1);
+        first           = FAT(tail)->next;
+        FAT(tail)->next = -1;
+        if (store_fat(below, tail) < 0) return -1;
     }
+    if (ino < NINODES) fat_cursor[ino].entry = -1;
 
-    return below->read(below, 0, get_data_block_number(fat_entry->next), block);
-    /* Student's code ends here. */
+    FAT(last)->next = SB.head;
+    SB.head         = first;
+    inode->size     = nblocks;
+    if (store_fat(below, last) < 0 || store_inode(below, ino) < 0) return -1;
+    return below->write(below, 0, 0, (block_t *)&SB);
 }
 
-int mydisk_write(inode_intf self, uint ino, uint offset, block_t* block) {
+int mydisk_read(inode_intf self, uint ino, uint offset, block_t* block) {
     /* Student's code goes here (File System). */
-
     inode_intf below = self->state;
-    
-    // Read superblock
-    if (below->read(below, 0, 0, (block_t *)&SB) < 0) {
-        return -1;
-    }
+    if (!mydisk_valid(below, ino) || offset >= INODE(ino)->size) return -1;
 
-    // Read inode
-    struct inode_block iblock;
-    struct inode *inode_to_write;
-
-    int inode_block_number = get_inode_block_number(ino);
-    if (below->read(below, 0, inode_block_number, (block_t *)&iblock) < 0) {
-        return -1;
-    }
-    
-    inode_to_write = get_inode_from_inode_block(ino, &iblock);
-    
-    // Move along linked list to offset or tail
-    uint num_blocks_to_allocate = offset - inode_to_write->size + 1;
-    
-    uint inode_head = inode_to_write->head == -1 ? SB.head : inode_to_write->head;
-    int num_jumps = offset >= inode_to_write->size ? inode_to_write->size : offset;
+    uint block_no = get_data_block_number(fat_seek(ino, offset));
+    return below->read(below, 0, block_no, block);
+    /* Student's code ends here. */
+}
 
-    struct fat_table_block  fat_block;
-    struct entry            dummy_fat_entry = {.next = inode_head};
-    struct entry            *fat_entry = &dummy_fat_entry;
-    uint                    fat_block_number;
+int mydisk_write(inode_intf self, uint ino, uint offset, block_t* block) {
+    /* Student's code goes here (File System). */
+    inode_intf below = self->state;
+    if (!mydisk_valid(below, ino)) return -1;
 
-    if (fat_walk(below, num_jumps, &fat_entry, &fat_block) < 0) {
+    /* Writing beyond the end of the file extends it up to offset. */
+    if (offset >= INODE(ino)->size && mydisk_grow(below, ino, offset + 1) < 0)
         return -1;
-    }
-
-    uint data_block_to_write = fat_entry->next;
-    if (num_blocks_to_allocate < 0) {
-        return below->write(below, 0, get_data_block_number(data_block_to_write), block);
-    }
-        
-    uint old_head = SB.head;
-
-    // 1. If inode->head == -1, set equal to SB.head, else Point inode_tail to head of free list
-    // 2. Traverse free list for (offset - size + 1) nodes
-    // 3. Point SB.head = free[offset - size + 1].next
-    // 4. Point free[offset - size + 1] = -1
-    // 5. Update inode size and write to disk
-
-    // 1.
-    if (inode_to_write->head == -1) {
-        fat_entry->next = SB.head;
-        inode_to_write->head = SB.head;
-    } else {
 
-        // Read in fat block if we didnt already
-        if (num_jumps <= 0) {
-            if (below->read(below, 0, get_fat_entry_block_number(fat_entry->next), (block_t *)&fat_block) < 0) {
-                return -1;
-            }
-            fat_entry = get_fat_entry_from_fat_table_block(fat_entry->next, &fat_block);
-        }
+    uint block_no = get_data_block_number(fat_seek(ino, offset));
+    return below->write(below, 0, block_no, block);
+    /* Student's code ends here. */
+}
 
-        // Point inode_tail to head of free list and write updated fat block to disk
-        fat_entry->next = SB.head;
-        if (below->write(below, 0, fat_block_number, (block_t *)&fat_block) < 0) {
+static int mydisk_range(inode_intf below, uint ino, uint offset, uint nblocks,
+                        block_t* blocks, int write) {
+    /* Move each run of blocks which are contiguous on the disk at once. */
+    for (uint i = 0, len; i < nblocks; i += len) {
+        int entry = fat_seek(ino, offset + i);
+        for (len = 1; i + len < nblocks; len++)
+            if (FAT(entry + len - 1)->next != entry + len) break;
+
+        uint block_no = get_data_block_number(entry);
+        if ((write ? inode_write_range : inode_read_range)(
+                below, 0, block_no, len, blocks + i) < 0)
             return -1;
-        }
     }
+    return 0;
+}
 
-    // 2. Traverse free list for (offset - size + 1) nodes
-    fat_walk(below, num_blocks_to_allocate - 1, &fat_entry, &fat_block);
-    data_block_to_write = fat_entry->next;
-    fat_walk(below, 1, &fat_entry, &fat_block);
-    fat_block_number = get_fat_entry_block_number(data_block_to_write);
-
-    // 3. Point SB.head = free[offset - size + 1].next and update superblock
-    SB.head = fat_entry->next;
-    if (below->write(below, 0, 0, (block_t *)&SB) < 0) {
+int mydisk_read_range(inode_intf self, uint ino, uint offset, uint nblocks,
+                      block_t* blocks) {
+    inode_intf below = self->state;
+    if (!mydisk_valid(below, ino) || offset + nblocks > INODE(ino)->size)
         return -1;
-    }
+    return mydisk_range(below, ino, offset, nblocks, blocks, 0);
+}
 
-    // 4. Point free[offset - size + 1] = -1
-    fat_entry->next = -1;
-    if (below->write(below, 0, fat_block_number, (block_t *)&fat_block) < 0) {
-        return -1;
-    }
-    
-    // 5. Update inode size and write to disk
-    inode_to_write->size +=  offset - inode_to_write->size + 1;
-    if (below->write(below, 0, inode_block_number, (block_t *)&iblock) < 0) {
-        return -1;
-    }
+int mydisk_write_range(inode_intf self, uint ino, uint offset, uint nblocks,
+                       block_t* blocks) {
+    inode_intf below = self->state;
+    if (!mydisk_valid(below, ino)) return -1;
 
-    
-    return below->write(below, 0, get_data_block_number(data_block_to_write), block);
-    /* Student's code ends here. */
+    uint end = offset + nblocks;
+    if (end > INODE(ino)->size && mydisk_grow(below, ino, end) < 0) return -1;
+    return mydisk_range(below, ino, offset, nblocks, blocks, 1);
 }
 
 int mydisk_getsize(inode_intf self, uint ino) {
     /* Student's code goes here (File System). */
     inode_intf below = self->state;
+    if (!mydisk_valid(below, ino)) return -1;
 
-    // Read superblock
-    if (below->read(below, 0, 0, (block_t *)&SB) < 0) {
-        return -1;
-    }
-
-    struct inode_block iblock;
-    struct inode *inode_to_read;
-
-    int inode_block_number = get_inode_block_number(ino);
-    if (below->read(below, 0, inode_block_number, (block_t *)&iblock) < 0) {
-        return -1;
-    }
-
-    inode_to_read = get_inode_from_inode_block(ino, &iblock);
-    return inode_to_read->size;
-    
-    /* Replace the code below with code for getting the size of an inode. */
+    return INODE(ino)->size;
     /* Student's code ends here. */
 }
 
 int mydisk_setsize(inode_intf self, uint ino, uint nblocks) {
     /* Student's code goes here (File System). */
     inode_intf below = self->state;
-    
-    // Read superblock
-    if (below->read(below, 0, 0, (block_t *)&SB) < 0) {
-        return -1;
-    }
-
-    // Read inode
-    struct inode_block iblock;
-    struct inode *inode_to_write;
-
-    int inode_block_number = get_inode_block_number(ino);
-    if (below->read(below, 0, inode_block_number, (block_t *)&iblock) < 0) {
-        return -1;
-    }
-
-    inode_to_write = get_inode_from_inode_block(ino, &iblock);
-
-
-    // Already have the right amount
-    if (inode_to_write->size == nblocks) {
-        return 0;
-    }
-
-    // Give nodes back
-    if (inode_to_write->size > nblocks) {
-        // Walk nblocks steps along fat, fat_entry is the last node we will keep
-        // Store old_head = SB.head
-        // Set SB.head = fat_entry->next
-        // If nblocks == 0 set inode_to_write->next = -1
-        // Walk inode_to_write->size - nblocks, this is the tail node of inode_to_write
-        // Set fat_entry->next = old_head
-        // Write inode_block
-        // Write superblock
-        // Write fatblock
-
-        uint number_of_blocks_to_return = inode_to_write->size - nblocks;
-
-        struct fat_table_block  fat_block;
-        struct entry            dummy_fat_entry = {.next = inode_to_write->head};
-        struct entry            *fat_entry = &dummy_fat_entry;
-        uint                    fat_block_number;
-
-        // Walk to last node
-        fat_walk(below, nblocks, &fat_entry, &fat_block);
-
-        uint sb_old_head = SB.head;
-        SB.head = fat_entry->next;
-
-        // Keep zero nodes
-        if (nblocks == 0) {
-            inode_to_write->head = -1;
-        }
-
-        // Walk to tail node
-        fat_walk(below, number_of_blocks_to_return, &fat_entry, &fat_block);
+    if (!mydisk_valid(below, ino)) return -1;
 
-        fat_entry->next = sb_old_head;
-
-        // Write inode_block
-        if (below->write(below, 0, get_inode_block_number(ino), (block_t *)&iblock) < 0) {
-            return -1;
-        }
-
-        // Write superblock
-        if (below->write(below, 0, 0, (block_t *)&SB) < 0) {
-            return -1;
-        }
-
-        // Write fatblock
-        if (below->write(below, 0, get_fat_entry_block_number(fat_entry->next), (block_t *)&fat_block) < 0) {
-            return -1;
-        }
-
-        return 1;
-    }
-
-    // Claim more nodes
-    uint num_blocks_to_allocate = nblocks - inode_to_write->size;
-    uint inode_head = inode_to_write->head == -1 ? SB.head : inode_to_write->head;
-
-    struct fat_table_block  fat_block;
-    struct entry            dummy_fat_entry = {.next = inode_head};
-    struct entry            *fat_entry = &dummy_fat_entry;
-    uint                    fat_block_number;
-
-    uint sb_old_head = SB.head;
-    
-    // Point inode_tail to head of free list and write updated fat block to disk
-    if (inode_to_write->size == 0) {
-        if (below->read(below, 0, get_fat_entry_block_number(fat_entry->next), (block_t *)&fat_block) < 0) {
-            return -1;
-        }
-        fat_entry = get_fat_entry_from_fat_table_block(fat_entry->next, &fat_block);
-    } 
-
-    fat_entry->next = SB.head;
-    if (below->write(below, 0, fat_block_number, (block_t *)&fat_block) < 0) {
-        return -1;
-    }
-
-    fat_walk(below, num_blocks_to_allocate, &fat_entry, &fat_block);
-
-    // 3. Point SB.head = free[offset - size + 1].next and update superblock
-    SB.head = fat_entry->next;
-    if (below->write(below, 0, 0, (block_t *)&SB) < 0) {
-        return -1;
-    }
-
-    // 4. Point free[offset - size + 1] = -1
-    fat_entry->next = -1;
-    if (below->write(below, 0, fat_block_number, (block_t *)&fat_block) < 0) {
-        return -1;
-    }
-
-    // 5. Update inode size and write to disk
-    inode_to_write->size = nblocks;
-    if (below->write(below, 0, inode_block_number, (block_t *)&iblock) < 0) {
-        return -1;
-    }
-
-    /* Replace the code below with code for changing the size of an inode. */
+    int size = INODE(ino)->size;
+    if (nblocks > size && mydisk_grow(below, ino, nblocks) < 0) return -1;
+    if (nblocks < size && mydisk_shrink(below, ino, nblocks) < 0) return -1;
+    return size;
     /* Student's code ends here. */
 }
 
@@ -458,6 +346,11 @@ int mydisk_create(inode_intf below, uint below_ino, uint ninodes) {
         
     }
 
+    /* The on-disk structures may have changed below the loaded ones. */
+    free(iblocks);
+    free(fblocks);
+    fblocks = NULL;
+
     /* Student's code ends here. */
     return 0;
 }
@@ -467,11 +360,13 @@ inode_intf mydisk_init(inode_intf below, uint below_ino) {
 
     /* Feel free to modify anything below if necessary. */
     inode_intf self = malloc(sizeof(struct inode_store));
-    self->getsize   = mydisk_getsize;
-    self->setsize   = mydisk_setsize;
-    self->read      = mydisk_read;
-    self->write     = mydisk_write;
-    self->state     = below;
+    self->getsize     = mydisk_getsize;
+    self->setsize     = mydisk_setsize;
+    self->read        = mydisk_read;
+    self->write       = mydisk_write;
+    self->read_range  = mydisk_read_range;
+    self->write_range = mydisk_write_range;
+    self->state       = below;
     return self;
     /* Student's code ends here. */
 }
@@ -47,12 +47,31 @@ struct treedisk_snapshot {
     struct treedisk_inode* inode;
 };
 
+/* A cached copy of an inode block or an indirect block.
+ */
+#define TREEDISK_NCACHED 8
+struct treedisk_cached {
+    block_no b; /* block number, or 0 if unused */
+    uint used;  /* time of the last use, for LRU replacement */
+    union treedisk_block block;
+};
+
 /* The state of a virtual inode store, which is identified by an inode number.
+ * Every access needs the superblock, an inode block and the indirect blocks
+ * on the path to the data block, so the state keeps copies of the superblock
+ * and of the recently used inode and indirect blocks.  All writes to the
+ * inode store below go through treedisk_write_below(), which updates these
+ * copies as well.
  */
 struct treedisk_state {
     inode_intf below; /* inode store below */
     uint below_ino;   /* inode number to use for the inode store below */
     uint ninodes;     /* number of inodes in the treedisk */
+
+    uint superblock_valid;
+    union treedisk_block superblock;
+    uint clock; /* incremented on every use of a cached block */
+    struct treedisk_cached cached[TREEDISK_NCACHED];
 };
 
 static uint log_rpb;       /* log2(REFS_PER_BLOCK) */
@@ -77,16 +96,75 @@ static block_no log_shift_r(block_no x, uint nbits) {
     return x >> nbits;
 }
 
+/* The number of levels of indirect blocks in a tree of nblocks blocks, i.e.,
+ * the smallest n such that (nblocks - 1) >> (n * log_rpb) is 0.
+ */
+static uint treedisk_nlevels(block_no nblocks) {
+    if (nblocks <= 1) return 0;
+    uint nbits = 32 - __builtin_clz(nblocks - 1);
+    return (nbits + log_rpb - 1) / log_rpb;
+}
+
+static struct treedisk_cached* treedisk_lookup(struct treedisk_state* ts,
+                                               block_no b) {
+    for (uint i = 0; i < TREEDISK_NCACHED; i++)
+        if (ts->cached[i].b == b) {
+            ts->cached[i].used = ++ts->clock;
+            return &ts->cached[i];
+        }
+    return NULL;
+}
+
+/* Read an inode block or an indirect block through the cache.
+ */
+static int treedisk_read_cached(struct treedisk_state* ts, block_no b,
+                                union treedisk_block** block) {
+    struct treedisk_cached* c = treedisk_lookup(ts, b);
+    if (c == NULL) {
+        c = &ts->cached[0];
+        for (uint i = 1; i < TREEDISK_NCACHED; i++)
+            if (ts->cached[i].used < c->used) c = &ts->cached[i];
+
+        c->b = 0;
+        if ((*ts->below->read)(ts->below, ts->below_ino, b,
+                               (block_t*)&c->block) < 0)
+            return -1;
+        c->b    = b;
+        c->used = ++ts->clock;
+    }
+    *block = &c->block;
+    return 0;
+}
+
+/* Write a block to the inode store below, and update its cached copy.
+ */
+static int treedisk_write_below(struct treedisk_state* ts, block_no b,
+                                block_t* block) {
+    struct treedisk_cached* c;
+    if (b == 0) {
+        memcpy(&ts->superblock, block, BLOCK_SIZE);
+        ts->superblock_valid = 1;
+    } else if ((c = treedisk_lookup(ts, b)) != NULL &&
+               (block_t*)&c->block != block) {
+        memcpy(&c->block, block, BLOCK_SIZE);
+    }
+    return (*ts->below->write)(ts->below, ts->below_ino, b, block);
+}
+
 /* Get a snapshot of the file system, including the superblock and the block
- * containing the inode, from the inode store below.
+ * containing the inode, from the cache or the inode store below.
  */
 static int treedisk_get_snapshot(struct treedisk_snapshot* snapshot,
                                  struct treedisk_state* ts, uint inode_no) {
     /* Get the superblock.
      */
-    if ((*ts->below->read)(ts->below, ts->below_ino, 0,
-                           (block_t*)&snapshot->superblock) < 0)
-        return -1;
+    if (!ts->superblock_valid) {
+        if ((*ts->below->read)(ts->below, ts->below_ino, 0,
+                               (block_t*)&ts->superblock) < 0)
+            return -1;
+        ts->superblock_valid = 1;
+    }
+    memcpy(&snapshot->superblock, &ts->superblock, BLOCK_SIZE);
 
     /* Check the inode number.
      */
@@ -99,10 +177,11 @@ static int treedisk_get_snapshot(struct treedisk_snapshot* snapshot,
 
     /* Find the inode.
      */
+    union treedisk_block* inodeblock;
     snapshot->inode_blockno = 1 + inode_no / INODES_PER_BLOCK;
-    if ((*ts->below->read)(ts->below, ts->below_ino, snapshot->inode_blockno,
-                           (block_t*)&snapshot->inodeblock) < 0)
+    if (treedisk_read_cached(ts, snapshot->inode_blockno, &inodeblock) < 0)
         return -1;
+    memcpy(&snapshot->inodeblock, inodeblock, BLOCK_SIZE);
 
     snapshot->inode =
         &snapshot->inodeblock.inodeblock.inodes[inode_no % INODES_PER_BLOCK];
@@ -118,7 +197,9 @@ static block_no treedisk_alloc_block(struct treedisk_state* ts,
     if ((b = snapshot->superblock.superblock.free_list) == 0)
         panic("treedisk_alloc_block: inode store is full\n");
 
-    /* Read the freelist block and scan for a free block reference.
+    /* Read the freelist block and scan for a free block reference.  The
+     * references are in increasing order, so take the lowest one first and
+     * the blocks of a file written sequentially are contiguous below.
      */
     union treedisk_block freelistblock;
     if ((*ts->below->read)(ts->below, ts->below_ino, b,
@@ -126,10 +207,11 @@ static block_no treedisk_alloc_block(struct treedisk_state* ts,
         panic("treedisk_alloc_block");
     }
     uint i;
-    for (i = REFS_PER_BLOCK; --i > 0;)
+    for (i = 1; i < REFS_PER_BLOCK; i++)
         if (freelistblock.freelistblock.refs[i] != 0) {
             break;
         }
+    if (i == REFS_PER_BLOCK) i = 0;
 
     /* If there is a free block reference use that.  Otherwise use
      * the free list block itself and update the superblock.
@@ -139,15 +221,13 @@ static block_no treedisk_alloc_block(struct treedisk_state* ts,
         free_blockno = b;
         snapshot->superblock.superblock.free_list =
             freelistblock.freelistblock.refs[0];
-        if ((*ts->below->write)(ts->below, ts->below_ino, 0,
-                                (block_t*)&snapshot->superblock) < 0) {
+        if (treedisk_write_below(ts, 0, (block_t*)&snapshot->superblock) < 0) {
             panic("treedisk_alloc_block: superblock");
         }
     } else {
         free_blockno = freelistblock.freelistblock.refs[i];
         freelistblock.freelistblock.refs[i] = 0;
-        if ((*ts->below->write)(ts->below, ts->below_ino, b,
-                                (block_t*)&freelistblock) < 0) {
+        if (treedisk_write_below(ts, b, (block_t*)&freelistblock) < 0) {
             panic("treedisk_alloc_block: freelistblock");
         }
     }
@@ -173,10 +253,32 @@ static int treedisk_setsize(inode_intf self, uint ino, block_no nblocks) {
     return -1;
 }
 
-/* Read a block at the given block number 'offset' and return in *block.
+/* Find the block number below of block 'offset' of the inode, or 0 if the
+ * block is a hole.
  */
-static int treedisk_read(inode_intf self, uint ino, block_no offset,
-                         block_t* block) {
+static int treedisk_map(struct treedisk_state* ts, struct treedisk_inode* inode,
+                        block_no offset, block_no* b) {
+    /* Walk down from the root block through the indirect blocks.
+     */
+    uint nlevels = treedisk_nlevels(inode->nblocks);
+    for (*b = inode->root; *b != 0 && nlevels > 0; nlevels--) {
+        union treedisk_block* tib;
+        if (treedisk_read_cached(ts, *b, &tib) < 0) return -1;
+
+        /* Figure out the index into this block and get the block number.
+         */
+        uint index = log_shift_r(offset, (nlevels - 1) * log_rpb) %
+                     REFS_PER_BLOCK;
+        *b = tib->indirblock.refs[index];
+    }
+    return 0;
+}
+
+/* Read the 'nblocks' blocks starting at block number 'offset' into *blocks.
+ * Blocks which are contiguous below are read with one call.
+ */
+static int treedisk_read_range(inode_intf self, uint ino, block_no offset,
+                               uint nblocks, block_t* blocks) {
     struct treedisk_state* ts = self->state;
 
     /* Get info from underlying file system.
@@ -186,49 +288,42 @@ static int treedisk_read(inode_intf self, uint ino, block_no offset,
 
     /* See if the offset is too big.
      */
-    if (offset >= snapshot.inode->nblocks) {
-        printf("!!TDERR: offset too large %u %u\n", offset,
+    if (offset + nblocks > snapshot.inode->nblocks) {
+        printf("!!TDERR: offset too large %u %u\n", offset + nblocks - 1,
                snapshot.inode->nblocks);
         return -1;
     }
 
-    /* Figure out how many levels there are in the tree.
-     */
-    uint nlevels = 0;
-    if (snapshot.inode->nblocks > 0)
-        while (log_shift_r(snapshot.inode->nblocks - 1, nlevels * log_rpb) !=
-               0) {
-            nlevels++;
-        }
+    for (uint i = 0, len; i < nblocks; i += len) {
+        block_no b, next;
+        if (treedisk_map(ts, snapshot.inode, offset + i, &b) < 0) return -1;
 
-    /* Walk down from the root block.
-     */
-    block_no b = snapshot.inode->root;
-    for (;;) {
         /* If there's a hole, return the null block.
          */
         if (b == 0) {
-            memset(block, 0, BLOCK_SIZE);
-            return 0;
+            memset(&blocks[i], 0, BLOCK_SIZE);
+            len = 1;
+            continue;
         }
 
-        /* Return the next level.  If the last level, we're done.
-         */
-        int result = (*ts->below->read)(ts->below, ts->below_ino, b, block);
-        if (result < 0) return result;
-        if (nlevels == 0) return 0;
-
-        /* The block is an indirect block.  Figure out the index into this
-         * block and get the block number.
-         */
-        nlevels--;
-        struct treedisk_indirblock* tib = (struct treedisk_indirblock*)block;
-        uint index = log_shift_r(offset, nlevels * log_rpb) % REFS_PER_BLOCK;
-        b          = tib->refs[index];
+        for (len = 1; i + len < nblocks; len++) {
+            if (treedisk_map(ts, snapshot.inode, offset + i + len, &next) < 0)
+                return -1;
+            if (next != b + len) break;
+        }
+        if (inode_read_range(ts->below, ts->below_ino, b, len, &blocks[i]) < 0)
+            return -1;
     }
     return 0;
 }
 
+/* Read a block at the given block number 'offset' and return in *block.
+ */
+static int treedisk_read(inode_intf self, uint ino, block_no offset,
+                         block_t* block) {
+    return treedisk_read_range(self, ino, offset, 1, block);
+}
+
 /* Write *block at the given block number 'offset'.
  */
 static int treedisk_write(inode_intf self, uint ino, block_no offset,
@@ -244,12 +339,7 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
 
     /* Figure out how many levels there are in the tree now.
      */
-    uint nlevels = 0;
-    if (snapshot->inode->nblocks > 0)
-        while (log_shift_r(snapshot->inode->nblocks - 1, nlevels * log_rpb) !=
-               0) {
-            nlevels++;
-        }
+    uint nlevels = treedisk_nlevels(snapshot->inode->nblocks);
 
     /* Figure out how many levels we need after writing.  Files cannot shrink
      * by writing.
@@ -258,10 +348,7 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
     if (offset >= snapshot->inode->nblocks) {
         snapshot->inode->nblocks = offset + 1;
         dirty_inode              = 1;
-        nlevels_after            = 0;
-        while (log_shift_r(offset, nlevels_after * log_rpb) != 0) {
-            nlevels_after++;
-        }
+        nlevels_after            = treedisk_nlevels(offset + 1);
     } else {
         nlevels_after = nlevels;
     }
@@ -281,8 +368,7 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
             tib.refs[0]           = snapshot->inode->root;
             snapshot->inode->root = indir;
             dirty_inode           = 1;
-            if ((*ts->below->write)(ts->below, ts->below_ino, indir,
-                                    (block_t*)&tib) < 0) {
+            if (treedisk_write_below(ts, indir, (block_t*)&tib) < 0) {
                 panic("treedisk_write: indirect block");
             }
 
@@ -293,9 +379,8 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
     /* If the inode block was updated, write it back now.
      */
     if (dirty_inode)
-        if ((*ts->below->write)(ts->below, ts->below_ino,
-                                snapshot->inode_blockno,
-                                (block_t*)&snapshot->inodeblock) < 0) {
+        if (treedisk_write_below(ts, snapshot->inode_blockno,
+                                 (block_t*)&snapshot->inodeblock) < 0) {
             panic("treedisk_write: inode block");
         }
 
@@ -312,16 +397,16 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
         struct treedisk_indirblock tib;
         if ((b = *parent_no) == 0) {
             b = *parent_no = treedisk_alloc_block(ts, snapshot);
-            if ((*ts->below->write)(ts->below, ts->below_ino, parent_off,
-                                    parent_block) < 0)
+            if (treedisk_write_below(ts, parent_off, parent_block) < 0)
                 panic("treedisk_write: parent");
             if (nlevels == 0) break;
             memset(&tib, 0, BLOCK_SIZE);
         } else {
             if (nlevels == 0) break;
-            if ((*ts->below->read)(ts->below, ts->below_ino, b,
-                                   (block_t*)&tib) < 0)
+            union treedisk_block* cached;
+            if (treedisk_read_cached(ts, b, &cached) < 0)
                 panic("treedisk_write");
+            memcpy(&tib, cached, BLOCK_SIZE);
         }
 
         /* Figure out the index into this block and get the block number.
@@ -333,11 +418,46 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
         parent_off   = b;
     }
 
-    if ((*ts->below->write)(ts->below, ts->below_ino, b, block) < 0)
+    if (treedisk_write_below(ts, b, block) < 0)
         panic("treedisk_write: data block");
     return 0;
 }
 
+/* Write the 'nblocks' blocks in *blocks starting at block number 'offset'.
+ * Blocks which are already allocated and contiguous below are written with
+ * one call, and the others one at a time by treedisk_write().
+ */
+static int treedisk_write_range(inode_intf self, uint ino, block_no offset,
+                                uint nblocks, block_t* blocks) {
+    struct treedisk_state* ts = self->state;
+
+    for (uint i = 0, len; i < nblocks; i += len) {
+        struct treedisk_snapshot snapshot;
+        block_no b = 0, next;
+        if (treedisk_get_snapshot(&snapshot, ts, ino) < 0) return -1;
+        if (offset + i < snapshot.inode->nblocks &&
+            treedisk_map(ts, snapshot.inode, offset + i, &b) < 0)
+            return -1;
+
+        len = 1;
+        if (b == 0) {
+            if (treedisk_write(self, ino, offset + i, &blocks[i]) < 0)
+                return -1;
+            continue;
+        }
+
+        for (; i + len < nblocks && offset + i + len < snapshot.inode->nblocks;
+             len++) {
+            if (treedisk_map(ts, snapshot.inode, offset + i + len, &next) < 0)
+                return -1;
+            if (next != b + len) break;
+        }
+        if (inode_write_range(ts->below, ts->below_ino, b, len, &blocks[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
 /* Open a virtual inode store on the specified inode of the inode store below.
  */
 
@@ -361,11 +481,13 @@ inode_intf treedisk_init(inode_intf below, uint below_ino) {
      */
     inode_intf self = malloc(sizeof(struct inode_store));
     memset(self, 0, sizeof(struct inode_store));
-    self->state   = ts;
-    self->getsize = treedisk_getsize;
-    self->setsize = treedisk_setsize;
-    self->read    = treedisk_read;
-    self->write   = treedisk_write;
+    self->state       = ts;
+    self->getsize     = treedisk_getsize;
+    self->setsize     = treedisk_setsize;
+    self->read        = treedisk_read;
+    self->write       = treedisk_write;
+    self->read_range  = treedisk_read_range;
+    self->write_range = treedisk_write_range;
     return self;
 }
 
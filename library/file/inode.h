@@ -10,7 +10,7 @@
  * A physical disk would typically just have one inode (inode 0), while
  * a virtualized disk may have many.  Each inode store module has an
  * 'init' function that returns a inode_intf.  The inode_intf is
- * a pointer to a structure that contains the following four methods:
+ * a pointer to a structure that contains the following methods:
  *
  * int getsize(inode_intf self, unsigned int ino)
  *   - returns the size of the inode store at the given inode number
@@ -26,6 +26,15 @@
  * int write(inode_intf self, unsigned int ino, uint offset, block_t *block)
  *   - writes *block to the block at the given inode number and offset
  *
+ * int read_range(inode_intf self, unsigned int ino, uint offset,
+ *                uint nblocks, block_t *blocks)
+ * int write_range(inode_intf self, unsigned int ino, uint offset,
+ *                 uint nblocks, block_t *blocks)
+ *   - read or write the nblocks blocks starting at offset, so that blocks
+ *     which are contiguous below can be moved in one transfer; these two are
+ *     optional (NULL), and inode_read_range() and inode_write_range() fall
+ *     back to one read or write per block
+ *
  * All these return -1 upon error (typically after printing the eason for
  * the error) and return 0 upon success.
  *
@@ -44,12 +53,39 @@ struct inode_store {
     int (*setsize)(inode_intf self, uint ino, uint newsize);
     int (*read)(inode_intf self, uint ino, uint offset, block_t* block);
     int (*write)(inode_intf self, uint ino, uint offset, block_t* block);
+    int (*read_range)(inode_intf self, uint ino, uint offset, uint nblocks,
+                      block_t* blocks);
+    int (*write_range)(inode_intf self, uint ino, uint offset, uint nblocks,
+                       block_t* blocks);
     void* state;
 };
 
+static inline int inode_read_range(inode_intf self, uint ino, uint offset,
+                                   uint nblocks, block_t* blocks) {
+    if (self->read_range)
+        return self->read_range(self, ino, offset, nblocks, blocks);
+    for (uint i = 0; i < nblocks; i++)
+        if (self->read(self, ino, offset + i, blocks + i) < 0) return -1;
+    return 0;
+}
+
+static inline int inode_write_range(inode_intf self, uint ino, uint offset,
+                                    uint nblocks, block_t* blocks) {
+    if (self->write_range)
+        return self->write_range(self, ino, offset, nblocks, blocks);
+    for (uint i = 0; i < nblocks; i++)
+        if (self->write(self, ino, offset + i, blocks + i) < 0) return -1;
+    return 0;
+}
+
 /* There are 2 file systems in egos-2000 right now: mydisk and treedisk. */
 inode_intf mydisk_init(inode_intf below, uint below_ino);
 int mydisk_create(inode_intf below, uint below_ino, uint ninodes);
 
 inode_intf treedisk_init(inode_intf below, uint below_ino);
 int treedisk_create(inode_intf below, uint below_ino, uint ninodes);
+
+/* A write-back block cache of nblocks blocks over any inode store below. */
+inode_intf cache_init(inode_intf below, uint nblocks);
+int cache_sync(inode_intf self);
+void cache_stats(inode_intf self);
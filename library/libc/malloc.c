@@ -2,22 +2,39 @@
  * (C) 2026, Cornell University
  * All rights reserved.
  *
- * Description: system support for C library function malloc()
+ * Description: malloc() and free() with size-class slabs
+ * Small objects are carved from 4KB slabs of a single size class, so that
+ * malloc() and free() take O(1) time; larger blocks are runs of pages. The
+ * pages come from _sbrk() and empty slabs are reused by any size class.
  */
 
 #include "egos.h"
+#include "servers.h"
+#include <string.h>
 
 /* Heap start and end are defined in library/elf/{egos/app}.lds. */
 extern char __heap_start, __heap_end;
-static char* brk = &__heap_start;
+static char* brk      = &__heap_start;
+static char* heap_end = &__heap_end;
 
-/* malloc() and free() are linked from the compiler's C library;
- * malloc() and free() manage the memory region [&__heap_start, brk).
+/* malloc() and free() manage the memory region [&__heap_start, brk).
  * If malloc() finds it too small, malloc() will call _sbrk() to increase brk.
+ * Build with MALLOC=newlib to use the malloc() of the C library instead.
  */
 
 char* _sbrk(int size) {
-    if (brk + size > (char*)&__heap_end) {
+#ifndef KERNEL
+    /* User applications continue the heap beyond __heap_end in anonymous
+     * memory from mmap_anon(); malloc() handles the discontiguous brk. */
+    if (brk + size > heap_end) {
+        if (heap_end == &__heap_end) brk = heap_end = (char*)APPS_MMAP_BASE;
+        uint new_end = ((uint)brk + size + 4095) & ~4095;
+        if (new_end <= APPS_MMAP_END &&
+            mmap_anon(heap_end, new_end - (uint)heap_end) == 0)
+            heap_end = (char*)new_end;
+    }
+#endif
+    if (brk + size > heap_end) {
         printf("_sbrk: heap grows too large\n\r");
         *(int*)(0) = 1; /* Trigger a memory exception. */
     }
@@ -26,3 +43,226 @@ char* _sbrk(int size) {
     brk += size;
     return old_brk;
 }
+
+#ifndef MALLOC_NEWLIB
+#define SLAB_SIZE     4096
+#define NCLASSES      7 /* 16, 32, ..., 1024 bytes */
+#define CLASS_SIZE(x) (16 << (x))
+#define CLASS_RUN     NCLASSES       /* a run of pages for a large block */
+#define CLASS_FREE    (NCLASSES + 1) /* a run of free pages */
+
+/* The header at the start of every slab or run of pages; the slab of an
+ * object is found by rounding the object address down to SLAB_SIZE. Runs
+ * know the size of their neighbors, so free runs are merged in O(1). */
+struct slab {
+    uchar class;        /* size class, CLASS_RUN or CLASS_FREE */
+    uchar last;         /* whether the run ends where _sbrk() stopped */
+    ushort nfree;       /* free objects in the slab */
+    ushort npages;      /* number of pages in the slab or run */
+    ushort prev_npages; /* pages of the run just before, or 0 */
+    void* free;         /* list of free objects in the slab */
+    struct slab *prev, *next; /* slabs with free objects, or free runs */
+};
+#define SLAB_HEADER 32 /* sizeof(struct slab) rounded up for alignment */
+
+static struct slab* partial[NCLASSES]; /* slabs with free objects */
+static struct slab* free_runs;
+static struct slab* top_run; /* the run which ends at brk */
+static uint stat_pages, stat_free_pages, stat_allocated;
+
+static void slab_unlink(struct slab** list, struct slab* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+static void slab_push(struct slab** list, struct slab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static struct slab* run_after(struct slab* run) {
+    return run->last ? NULL : (void*)((char*)run + run->npages * SLAB_SIZE);
+}
+
+static struct slab* run_before(struct slab* run) {
+    return run->prev_npages ? (void*)((char*)run - run->prev_npages * SLAB_SIZE)
+                            : NULL;
+}
+
+static void run_resize(struct slab* run, uint npages) {
+    run->npages       = npages;
+    struct slab* next = run_after(run);
+    if (next) next->prev_npages = npages;
+}
+
+static void run_merge(struct slab* run, struct slab* next) {
+    /* Append next, the run just after run, to run. */
+    run->last = next->last;
+    if (top_run == next) top_run = run;
+    run_resize(run, run->npages + next->npages);
+}
+
+static struct slab* pages_alloc(uint npages) {
+    /* Take the first free run which is large enough, or grow the heap. */
+    for (struct slab* run = free_runs; run; run = run->next) {
+        if (run->npages < npages) continue;
+        slab_unlink(&free_runs, run);
+        if (run->npages > npages) {
+            struct slab* rest = (void*)((char*)run + npages * SLAB_SIZE);
+            rest->class       = CLASS_FREE;
+            rest->last        = run->last;
+            rest->prev_npages = npages;
+            run->last         = 0;
+            if (top_run == run) top_run = rest;
+            run_resize(rest, run->npages - npages);
+            run->npages = npages;
+            slab_push(&free_runs, rest);
+        }
+        stat_free_pages -= npages;
+        return run;
+    }
+
+    uint pad = -(uint)_sbrk(0) & (SLAB_SIZE - 1);
+    if (pad) _sbrk(pad);
+    struct slab* run = (void*)_sbrk(npages * SLAB_SIZE);
+    run->npages      = npages;
+    run->last        = 1;
+    run->prev_npages = 0;
+    if (top_run &&
+        (char*)top_run + top_run->npages * SLAB_SIZE == (char*)run) {
+        top_run->last    = 0;
+        run->prev_npages = top_run->npages;
+    }
+    top_run = run;
+    stat_pages += npages;
+    return run;
+}
+
+static void pages_free(struct slab* run) {
+    stat_free_pages += run->npages;
+    run->class = CLASS_FREE;
+
+    struct slab* next = run_after(run);
+    if (next && next->class == CLASS_FREE) {
+        slab_unlink(&free_runs, next);
+        run_merge(run, next);
+    }
+    struct slab* prev = run_before(run);
+    if (prev && prev->class == CLASS_FREE) return run_merge(prev, run);
+    slab_push(&free_runs, run);
+}
+
+static int size_to_class(uint size) {
+    int class = 0;
+    while (class < NCLASSES && CLASS_SIZE(class) < size) class++;
+    return class;
+}
+
+void* malloc(size_t size) {
+    int class = size_to_class(size);
+
+    if (class == NCLASSES) {
+        uint npages = (size + SLAB_HEADER + SLAB_SIZE - 1) / SLAB_SIZE;
+        struct slab* run = pages_alloc(npages);
+        run->class       = CLASS_RUN;
+        stat_allocated += npages * SLAB_SIZE;
+        return (char*)run + SLAB_HEADER;
+    }
+
+    struct slab* slab = partial[class];
+    if (!slab) {
+        /* Carve a new slab into objects of the size class. */
+        slab        = pages_alloc(1);
+        slab->class = class;
+        slab->nfree = 0;
+        slab->free  = NULL;
+        for (int off = SLAB_SIZE - CLASS_SIZE(class); off >= SLAB_HEADER;
+             off -= CLASS_SIZE(class)) {
+            void** obj = (void*)((char*)slab + off);
+            *obj       = slab->free;
+            slab->free = obj;
+            slab->nfree++;
+        }
+        slab_push(&partial[class], slab);
+    }
+
+    void** obj = slab->free;
+    slab->free = *obj;
+    if (--slab->nfree == 0) slab_unlink(&partial[class], slab);
+    stat_allocated += CLASS_SIZE(class);
+    return obj;
+}
+
+static uint slab_capacity(int class) {
+    return (SLAB_SIZE - SLAB_HEADER) / CLASS_SIZE(class);
+}
+
+void free(void* ptr) {
+    if (!ptr) return;
+    struct slab* slab = (void*)((uint)ptr & ~(SLAB_SIZE - 1));
+    if (slab->class == CLASS_RUN) {
+        stat_allocated -= slab->npages * SLAB_SIZE;
+        return pages_free(slab);
+    }
+
+    int class = slab->class;
+    *(void**)ptr = slab->free;
+    slab->free   = ptr;
+    stat_allocated -= CLASS_SIZE(class);
+    if (slab->nfree++ == 0) slab_push(&partial[class], slab);
+
+    /* Give an empty slab back unless it is the last one of its class. */
+    if (slab->nfree == slab_capacity(class) && partial[class] != slab) {
+        slab_unlink(&partial[class], slab);
+        pages_free(slab);
+    }
+}
+
+static uint slab_usable_size(void* ptr) {
+    struct slab* slab = (void*)((uint)ptr & ~(SLAB_SIZE - 1));
+    return slab->class == CLASS_RUN ? slab->npages * SLAB_SIZE - SLAB_HEADER
+                                   : CLASS_SIZE(slab->class);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    void* ptr = malloc(nmemb * size);
+    memset(ptr, 0, nmemb * size);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr && size <= slab_usable_size(ptr)) return ptr;
+    void* new_ptr = malloc(size);
+    if (ptr) {
+        memcpy(new_ptr, ptr, slab_usable_size(ptr));
+        free(ptr);
+    }
+    return new_ptr;
+}
+
+/* The C library calls the reentrant versions internally (e.g., in printf). */
+void* _malloc_r(void* reent, size_t size) { return malloc(size); }
+void _free_r(void* reent, void* ptr) { free(ptr); }
+void* _calloc_r(void* reent, size_t nmemb, size_t size) {
+    return calloc(nmemb, size);
+}
+void* _realloc_r(void* reent, void* ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+void malloc_stats() {
+    /* Fragmentation is the share of free objects in partially used slabs;
+     * free pages are kept for later use by any size class. */
+    uint idle = 0;
+    for (int class = 0; class < NCLASSES; class++)
+        for (struct slab* slab = partial[class]; slab; slab = slab->next)
+            idle += slab->nfree * CLASS_SIZE(class);
+    INFO("malloc: %d heap pages (%d free), %d bytes allocated, %d bytes in "
+         "free objects (%d%% fragmented)", stat_pages, stat_free_pages,
+         stat_allocated, idle,
+         idle ? idle * 100 / (idle + stat_allocated) : 0);
+}
+#endif
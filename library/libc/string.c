@@ -0,0 +1,111 @@
+/*
+ * (C) 2026, Cornell University
+ * All rights reserved.
+ *
+ * Description: memcpy(), memset() and memcmp() for rv32ima
+ * These replace the ones from the compiler's C library. They move one word
+ * at a time and 8 words per loop iteration once the destination is aligned,
+ * and memcpy() combines two aligned loads when the source is misaligned
+ * since the CPU may not support misaligned access. The page_* variants are
+ * for page-aligned pages, e.g., in earth/cpu_mmu.c.
+ */
+
+#include "egos.h"
+#include <string.h>
+
+/* Apps are built without -O; this also keeps the compiler from turning the
+ * loops below into calls of these very functions. */
+#define FAST __attribute__((optimize("O2", "no-tree-loop-distribute-patterns")))
+
+FAST void* memcpy(void* dst, const void* src, size_t n) {
+    uchar* d       = dst;
+    const uchar* s = src;
+
+    for (; ((uint)d & 3) && n; n--) *d++ = *s++;
+    uint* dw = (uint*)d;
+
+    if (((uint)s & 3) == 0) {
+        const uint* sw = (const uint*)s;
+        for (; n >= 32; n -= 32, dw += 8, sw += 8) {
+            uint w0 = sw[0], w1 = sw[1], w2 = sw[2], w3 = sw[3];
+            uint w4 = sw[4], w5 = sw[5], w6 = sw[6], w7 = sw[7];
+            dw[0] = w0, dw[1] = w1, dw[2] = w2, dw[3] = w3;
+            dw[4] = w4, dw[5] = w5, dw[6] = w6, dw[7] = w7;
+        }
+        for (; n >= 4; n -= 4) *dw++ = *sw++;
+        s = (const uchar*)sw;
+    } else if (n >= 4) {
+        /* Load the aligned words around the source, which never crosses a
+         * page boundary beyond the last byte, and shift them into place. */
+        uint shift     = ((uint)s & 3) * 8;
+        const uint* sw = (const uint*)((uint)s & ~3);
+        uint w0        = *sw++;
+        for (; n >= 4; n -= 4) {
+            uint w1 = *sw++;
+            *dw++   = (w0 >> shift) | (w1 << (32 - shift));
+            w0      = w1;
+        }
+        s = (const uchar*)sw - 4 + shift / 8;
+    }
+
+    for (d = (uchar*)dw; n; n--) *d++ = *s++;
+    return dst;
+}
+
+FAST void* memset(void* dst, int c, size_t n) {
+    uchar* d = dst;
+    for (; ((uint)d & 3) && n; n--) *d++ = c;
+
+    uint w   = (uchar)c * 0x01010101U;
+    uint* dw = (uint*)d;
+    for (; n >= 32; n -= 32, dw += 8) {
+        dw[0] = w, dw[1] = w, dw[2] = w, dw[3] = w;
+        dw[4] = w, dw[5] = w, dw[6] = w, dw[7] = w;
+    }
+    for (; n >= 4; n -= 4) *dw++ = w;
+
+    for (d = (uchar*)dw; n; n--) *d++ = c;
+    return dst;
+}
+
+FAST int memcmp(const void* a, const void* b, size_t n) {
+    const uchar *x = a, *y = b;
+
+    /* Skip the equal words, and then find the different byte. */
+    if ((((uint)x | (uint)y) & 3) == 0)
+        for (; n >= 4 && *(const uint*)x == *(const uint*)y; n -= 4)
+            x += 4, y += 4;
+
+    for (; n; n--, x++, y++)
+        if (*x != *y) return *x - *y;
+    return 0;
+}
+
+FAST void page_copy(void* dst, const void* src) {
+    uint* dw       = dst;
+    const uint* sw = src;
+    for (uint i = 0; i < 4096 / 4; i += 8) {
+        uint w0 = sw[i], w1 = sw[i + 1], w2 = sw[i + 2], w3 = sw[i + 3];
+        uint w4 = sw[i + 4], w5 = sw[i + 5], w6 = sw[i + 6], w7 = sw[i + 7];
+        dw[i] = w0, dw[i + 1] = w1, dw[i + 2] = w2, dw[i + 3] = w3;
+        dw[i + 4] = w4, dw[i + 5] = w5, dw[i + 6] = w6, dw[i + 7] = w7;
+    }
+}
+
+FAST void page_zero(void* dst) {
+    uint* dw = dst;
+    for (uint i = 0; i < 4096 / 4; i += 8) {
+        dw[i] = 0, dw[i + 1] = 0, dw[i + 2] = 0, dw[i + 3] = 0;
+        dw[i + 4] = 0, dw[i + 5] = 0, dw[i + 6] = 0, dw[i + 7] = 0;
+    }
+}
+
+FAST uint page_diff(const void* a, const void* b) {
+    const uint *x = a, *y = b;
+    for (uint i = 0; i < 4096 / 4; i += 4)
+        if ((x[i] ^ y[i]) | (x[i + 1] ^ y[i + 1]) | (x[i + 2] ^ y[i + 2]) |
+            (x[i + 3] ^ y[i + 3]))
+            for (;; i++)
+                if (x[i] != y[i]) return i * 4;
+    return 4096;
+}
@@ -7,7 +7,6 @@
 
 #include "egos.h"
 #include "syscall.h"
-#include <stdlib.h>
 
 static int sender;
 static char buf[SYSCALL_MSG_LEN];
@@ -29,32 +28,81 @@ void sleep(uint usec) {
     /* Student's code ends here. */
 }
 
+int mmap_anon(void* addr, uint len) {
+    /* Pages in [addr, addr + len) are allocated on the first access. */
+    struct proc_request req;
+    req.type  = PROC_MMAP;
+    req.vaddr = (uint)addr;
+    req.argc  = len;
+
+    sys_send(GPID_PROCESS, (void*)&req, sizeof(req));
+    sys_recv(GPID_PROCESS, &sender, buf, SYSCALL_MSG_LEN);
+
+    struct proc_reply* reply = (void*)buf;
+    return reply->type == CMD_OK ? 0 : -1;
+}
+
 int dir_lookup(int dir_ino, char* name) {
-    char buf[BLOCK_SIZE];
-    file_read(dir_ino, 0, buf);
+    /* GPID_FILE looks the name up in its dentry cache or the directory. */
+    struct file_request req;
+    req.type = FILE_LOOKUP;
+    req.ino  = dir_ino;
+    req.len  = strlen(name) + 1;
+    if (req.len > FILE_DATA_LEN) return -1;
+    memcpy(req.data, name, req.len);
 
-    /* Read tools/mkfs.c to understand directory management. */
-    for (uint i = 0, namelen = strlen(name); i < strlen(buf) - namelen; i++)
-        if (!strncmp(name, buf + i, namelen) && buf[i + namelen] == ' ' &&
-            (i == 0 || buf[i - 1] == ' '))
-            return atoi(buf + i + namelen);
+    sys_send(GPID_FILE, (void*)&req, sizeof(req) - FILE_DATA_LEN + req.len);
+    sys_recv(GPID_FILE, &sender, buf, SYSCALL_MSG_LEN);
 
-    return -1;
+    struct file_reply* reply = (void*)buf;
+    return reply->status == FILE_OK ? reply->ino : -1;
 }
 
 int file_read(int file_ino, uint offset, char* block) {
+    /* Read the block at offset, which counts blocks instead of bytes. */
+    int n = file_pread(file_ino, offset * BLOCK_SIZE, BLOCK_SIZE, block);
+    return n == BLOCK_SIZE ? 0 : -1;
+}
+
+int file_pread(int file_ino, uint offset, uint len, char* dst) {
+    /* Return the number of bytes read, which stops at the end of the file. */
     struct file_request req;
     req.type   = FILE_READ;
     req.ino    = file_ino;
     req.offset = offset;
+    req.len    = len;
+    sys_send(GPID_FILE, (void*)&req, sizeof(req) - FILE_DATA_LEN);
 
-    sys_send(GPID_FILE, (void*)&req, sizeof(req));
-    sys_recv(GPID_FILE, &sender, buf, SYSCALL_MSG_LEN);
-
+    uint n                   = 0;
     struct file_reply* reply = (void*)buf;
-    memcpy(block, reply->block.bytes, BLOCK_SIZE);
+    do {
+        sys_recv(GPID_FILE, &sender, buf, SYSCALL_MSG_LEN);
+        if (reply->status != FILE_OK) return -1;
+        memcpy(dst + n, reply->data, reply->len);
+        n += reply->len;
+    } while (reply->remaining);
+    return n;
+}
+
+int file_pwrite(int file_ino, uint offset, uint len, char* src) {
+    /* A write beyond the end of the file extends the file. */
+    struct file_request req;
+    req.type   = FILE_WRITE;
+    req.ino    = file_ino;
+    req.offset = offset;
+    req.len    = len;
+
+    uint n = 0;
+    do {
+        uint size = (len - n < FILE_DATA_LEN) ? len - n : FILE_DATA_LEN;
+        memcpy(req.data, src + n, size);
+        sys_send(GPID_FILE, (void*)&req, sizeof(req) - FILE_DATA_LEN + size);
+        n += size;
+    } while (n < len);
 
-    return reply->status == FILE_OK ? 0 : -1;
+    sys_recv(GPID_FILE, &sender, buf, SYSCALL_MSG_LEN);
+    struct file_reply* reply = (void*)buf;
+    return reply->status == FILE_OK ? len : -1;
 }
 
 #ifndef KERNEL
@@ -2,10 +2,13 @@
 
 void exit(int status);
 void sleep(uint usec);
+int mmap_anon(void* addr, uint len);
 int term_read(char* buf, uint len);
 void term_write(char* str, uint len);
 int dir_lookup(int dir_ino, char* name);
 int file_read(int file_ino, uint offset, char* block);
+int file_pread(int file_ino, uint offset, uint len, char* buf);
+int file_pwrite(int file_ino, uint offset, uint len, char* buf);
 
 enum grass_servers {
     GPID_ALL = -1,
@@ -25,10 +28,15 @@ struct proc_request {
     /* Student's code goes here (System Call & Protection). */
 
     /* Update struct proc_request to support process sleep. */
-    enum { PROC_SPAWN, PROC_EXIT, PROC_KILLALL, PROC_SLEEP, PROC_CORESINFO } type;
+    enum { PROC_SPAWN, PROC_EXIT, PROC_KILLALL, PROC_SLEEP, PROC_CORESINFO, PROC_PAGEIN, PROC_MMAP } type;
     int argc;
     char argv[CMD_NARGS][CMD_ARG_LEN];
     /* Student's code ends here. */
+
+    /* PROC_PAGEIN is sent by the kernel on behalf of a process faulting on
+     * a page mapped with earth->mmu_map_lazy(); see grass/kernel.c.
+     * PROC_MMAP maps argc bytes of anonymous memory at vaddr. */
+    uint vaddr, tag;
 };
 
 struct proc_reply {
@@ -50,18 +58,30 @@ struct term_reply {
 
 /* GPID_FILE */
 #include "disk.h"
+
+/* A request names a range of bytes in a file. The data of FILE_READ comes
+ * back in a sequence of replies, and the data of FILE_WRITE follows in a
+ * sequence of requests (only data is used after the first one) answered by
+ * one reply. Each message holds up to FILE_DATA_LEN bytes of the range so
+ * that it fits in SYSCALL_MSG_LEN. FILE_LOOKUP finds the name in data in the
+ * directory ino (see library/file/dir.h). */
+#define FILE_DATA_LEN 1008
 struct file_request {
     enum {
         FILE_UNUSED,
         FILE_READ,
         FILE_WRITE,
+        FILE_LOOKUP,
     } type;
     uint ino;
-    uint offset;
-    block_t block;
+    uint offset, len; /* in bytes */
+    char data[FILE_DATA_LEN];
 };
 
 struct file_reply {
     enum file_status { FILE_OK, FILE_ERROR } status;
-    block_t block;
+    uint len;       /* bytes in data */
+    uint remaining; /* bytes in the replies after this one */
+    uint ino;       /* the inode found by FILE_LOOKUP */
+    char data[FILE_DATA_LEN];
 };
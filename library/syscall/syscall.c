@@ -7,6 +7,7 @@
 
 #include "egos.h"
 #include "syscall.h"
+#include "disk.h"
 
 static struct syscall* sc = (struct syscall*)SYSCALL_ARG;
 
@@ -24,3 +25,45 @@ void sys_recv(int from, int* sender, char* buf, uint size) {
     memcpy(buf, sc->content, size);
     if (sender) *sender = sc->sender;
 }
+
+int sys_fork() {
+    /* The kernel returns the child pid to the parent and 0 to the child
+     * in register a0, or -1 if the address space cannot be duplicated. */
+    register int pid asm("a0");
+    sc->type = SYS_FORK;
+    asm volatile("ecall" : "=r"(pid) : : "memory");
+    return pid;
+}
+
+void sys_disk(uint block_no, uint nblocks, char* buf, int write) {
+    /* The process is blocked while the kernel moves the blocks with DMA.
+     * The kernel returns in a0 the number of blocks it could not move (e.g.,
+     * with the SPI bus on the hardware), which are then moved right here. */
+    register int left asm("a0");
+    struct disk_request* req = (void*)sc->content;
+    sc->type                 = SYS_DISK;
+    req->block_no            = block_no;
+    req->nblocks             = nblocks;
+    req->buf                 = buf;
+    req->write               = write;
+    asm volatile("ecall" : "=r"(left) : : "memory");
+    if (left == 0) return;
+
+    block_no += nblocks - left;
+    buf += (nblocks - left) * BLOCK_SIZE;
+    write ? earth->disk_write(block_no, left, buf)
+          : earth->disk_read(block_no, left, buf);
+}
+
+uint sys_mmu(uint op, uint arg0, uint arg1, uint arg2) {
+    /* The kernel runs the MMU call and returns its result in a0. */
+    register uint ret asm("a0");
+    struct mmu_request* req = (void*)sc->content;
+    sc->type                = SYS_MMU;
+    req->op                 = op;
+    req->args[0]            = arg0;
+    req->args[1]            = arg1;
+    req->args[2]            = arg2;
+    asm volatile("ecall" : "=r"(ret) : : "memory");
+    return ret;
+}
@@ -6,16 +6,34 @@
 enum syscall_type {
     SYS_RECV = 1,
     SYS_SEND = 2,
+    SYS_FORK = 3,
+    SYS_DISK = 4,
+    SYS_MMU  = 5,
 };
 
 #define SYSCALL_MSG_LEN 1024
 struct syscall {
-    enum syscall_type type; /* SYS_SEND or SYS_RECV */
+    enum syscall_type type; /* SYS_SEND, SYS_RECV, SYS_FORK, SYS_DISK, ... */
     int sender;             /* sender process ID    */
     int receiver;           /* receiver process ID  */
     char content[SYSCALL_MSG_LEN];
     enum { PENDING, DONE } status;
 };
 
+/* The content of a SYS_DISK system call. */
+struct disk_request {
+    uint block_no, nblocks;
+    char* buf;
+    int write;
+};
+
+/* The content of a SYS_MMU system call; see mmu_syscall() in cpu_mmu.c. */
+struct mmu_request {
+    uint op, args[3];
+};
+
 void sys_send(int receiver, char* msg, uint size);
 void sys_recv(int from, int* sender, char* buf, uint size);
+int sys_fork();
+void sys_disk(uint block_no, uint nblocks, char* buf, int write);
+uint sys_mmu(uint op, uint arg0, uint arg1, uint arg2);
@@ -3,9 +3,10 @@
  * All rights reserved.
  *
  * Description: generate disk image (disk.img) and ROM image (fpgaROM.bin)
- * The disk image should be exactly 4MB:
+ * The disk image should be exactly 8MB (QEMU requires a power of 2):
  *     2MB holds the executables of EGOS and system servers;
- *     2MB is managed by a file system.
+ *     2MB is managed by a file system;
+ *     4MB is the swap area for cold user pages (see earth/cpu_mmu.c).
  * This disk image should be programmed to the microSD card.
  *
  * The ROM image should be exactly 8MB:
@@ -23,6 +24,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include "dir.h"
 #include "inode.h"
 
 char* egos_binaries[] = {"./egos.bin",
@@ -33,8 +35,10 @@ char* egos_binaries[] = {"./egos.bin",
                          "./images/Bohr.bmp" /* for the video demo app */};
 #define EGOS_BIN_NUM ((sizeof(egos_binaries) / sizeof(char*)))
 
-char bin_dir[256] = "./   6 ../   0 ";
-char* contents[]  = {
+/* The directories are given as "name ino " pairs, and dir_write() writes
+ * them in the format of library/file/dir.h; README is a plain file. */
+char bin_dir[4096] = "./   6 ../   0 ";
+char* contents[]   = {
     "./   0 ../   0 home/   1 bin/   6 ",
     "./   1 ../   0 yunhao/   2 rvr/   3 yacqub/   4 ",
     "./   2 ../   1 README   5 ",
@@ -47,6 +51,7 @@ char* contents[]  = {
      "Moreover, the EGOS book (https://egos.fun) contains 9 course projects.",
     bin_dir};
 #define BIN_DIR_INODE ((sizeof(contents) / sizeof(char*)) - 1)
+#define README_INODE  5
 
 char inode[SIZE_2MB], tmp[512];
 char vexriscv[SIZE_2MB * 2], exec[SIZE_2MB], fs[SIZE_2MB];
@@ -76,6 +81,34 @@ int ramwrite(inode_intf bs, uint ino, uint offset, block_t* block) {
     return 0;
 }
 
+void dir_write(inode_intf filesys, uint ino, char* pairs) {
+    /* Parse the entries. */
+    static struct dir_entry entries[256];
+    char name[256];
+    uint n = 0;
+    for (int len; sscanf(pairs, "%255s %d%n", name, &entries[n].ino, &len) == 2;
+         pairs += len) {
+        assert(strlen(name) < DIR_NAME_LEN && n + 1 < 256);
+        strcpy(entries[n++].name, name);
+    }
+
+    /* Put each entry in the first block with room from the one of its hash,
+     * with twice as many entries as needed, and write the blocks. */
+    uint nblocks = (2 * n + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK;
+    struct dir_block* blocks = calloc(nblocks, sizeof(struct dir_block));
+    for (uint i = 0; i < n; i++) {
+        uint b = dir_hash(entries[i].name) % nblocks, j;
+        while (blocks[b].entries[DIR_ENTRIES_PER_BLOCK - 1].name[0])
+            b = (b + 1) % nblocks;
+        for (j = 0; blocks[b].entries[j].name[0]; j++);
+        blocks[b].entries[j] = entries[i];
+    }
+    inode_write_range(filesys, ino, 0, nblocks, (void*)blocks);
+    free(blocks);
+    printf("[INFO] Load ino=%d, directory of %d entries in %d blocks\n", ino,
+           n, nblocks);
+}
+
 int main() {
     /* Write the kernel and system server binaries into exec[]. */
     printf("[INFO] Load %ld kernel binary files\n", EGOS_BIN_NUM);
@@ -97,6 +130,10 @@ int main() {
 
     /* Write to inode 0..BIN_DIR_INODE-1 in the file system. */
     for (uint ino = 0; ino < BIN_DIR_INODE; ino++) {
+        if (ino != README_INODE) {
+            dir_write(filesys, ino, contents[ino]);
+            continue;
+        }
         printf("[INFO] Load ino=%d, %ld bytes\n", ino, strlen(contents[ino]));
         strncpy(inode, contents[ino], BLOCK_SIZE);
         filesys->write(filesys, ino, 0, (void*)inode);
@@ -124,13 +161,15 @@ int main() {
             strcat(bin_dir, tmp);
         }
     closedir(dp);
-    filesys->write(filesys, BIN_DIR_INODE, 0, (void*)bin_dir);
-    printf("[INFO] Load ino=%ld, %s\n", BIN_DIR_INODE, bin_dir);
+    dir_write(filesys, BIN_DIR_INODE, bin_dir);
 
     /* Generate the disk image file. */
     int fd  = open("disk.img", O_CREAT | O_WRONLY, 0666);
     int sz1 = write(fd, exec, SIZE_2MB);
     sz1 += write(fd, fs, SIZE_2MB);
+    memset(tmp, 0, sizeof(tmp));
+    for (uint i = 0; i < SWAP_DISK_SIZE / sizeof(tmp); i++)
+        sz1 += write(fd, tmp, sizeof(tmp));
     close(fd);
 
     /* Generate the ROM image files. */
@@ -147,7 +186,7 @@ int main() {
     /* Simply pad the image to 32MB which is required by QEMU. */
     close(fd);
 
-    assert(sz1 == SIZE_2MB * 2 && sz2 == SIZE_2MB * 4 && sz3 == SIZE_2MB * 16);
+    assert(sz1 == SIZE_2MB * 4 && sz2 == SIZE_2MB * 4 && sz3 == SIZE_2MB * 16);
     printf("[INFO] Finish making the image files\n");
     return 0;
 }